@@ -29,14 +29,78 @@ typedef enum
     OP_SET_LOCAL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    OP_GET_CAPTURED,
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
     OP_CALL,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
+
+    // Quickened forms. The generic arithmetic and comparison instructions
+    // rewrite themselves into these once they see their operand types, and
+    // these rewrite themselves back when a type guard fails.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+
+    // Superinstructions: common instruction sequences fused by the compiler.
+    OP_GET_LOCAL_2,       // OP_GET_LOCAL a; OP_GET_LOCAL b
+    OP_SET_LOCAL_POP,     // OP_SET_LOCAL; OP_POP
+    OP_SET_GLOBAL_POP,    // OP_SET_GLOBAL; OP_POP
+    OP_ADD_CONSTANT,      // OP_CONSTANT (number); OP_ADD
+    OP_SUBTRACT_CONSTANT, // OP_CONSTANT (number); OP_SUBTRACT
+    OP_MULTIPLY_CONSTANT, // OP_CONSTANT (number); OP_MULTIPLY
+    OP_DIVIDE_CONSTANT,   // OP_CONSTANT (number); OP_DIVIDE
+    OP_NOT_EQUAL,         // OP_EQUAL; OP_NOT
+    OP_GREATER_EQUAL,     // OP_LESS; OP_NOT
+    OP_LESS_EQUAL,        // OP_GREATER; OP_NOT
+
+    // Conditional branches. Each pops the condition (or both compared
+    // operands) and jumps forward when the condition is false.
+    OP_JUMP_IF_NOT_LESS,    // OP_LESS; OP_JUMP_IF_FALSE; OP_POP
+    OP_JUMP_IF_NOT_GREATER, // OP_GREATER; OP_JUMP_IF_FALSE; OP_POP
+    OP_JUMP_IF_NOT_EQUAL,   // OP_EQUAL; OP_JUMP_IF_FALSE; OP_POP
+    OP_JUMP_IF_EQUAL,       // OP_NOT_EQUAL; OP_JUMP_IF_FALSE; OP_POP
+    OP_JUMP_IF_LESS,        // OP_GREATER_EQUAL; OP_JUMP_IF_FALSE; OP_POP
+    OP_JUMP_IF_GREATER,     // OP_LESS_EQUAL; OP_JUMP_IF_FALSE; OP_POP
+    OP_POP_JUMP_IF_FALSE,   // OP_JUMP_IF_FALSE; OP_POP
+    OP_POP_JUMP_IF_TRUE,    // OP_NOT; OP_JUMP_IF_FALSE; OP_POP
+
+    // A call in tail position, always followed by OP_RETURN. Closures reuse
+    // the caller's frame; anything else is called normally and the
+    // OP_RETURN hands back its result.
+    OP_TAIL_CALL,
+
+    // Inlined calls. OP_INLINE_GUARD checks that the callee under the
+    // arguments is still the function whose body follows, and otherwise
+    // jumps past the body to an ordinary OP_CALL. The body reads its
+    // arguments with OP_PEEK and ends in OP_INLINE_RETURN, which drops the
+    // callee and arguments from under the result.
+    OP_INLINE_GUARD,  // Two-byte jump, then the function's constant.
+    OP_PEEK,          // Pushes the value `operand` slots below the top.
+    OP_INLINE_RETURN, // Drops the `operand` values under the top one.
+
+    // Prefix for an instruction whose operand doesn't fit its short form:
+    // OP_CONSTANT, the local, upvalue and global accesses, OP_CLOSURE (whose
+    // upvalue indexes widen too), and the unfused jumps. The operand that
+    // follows the opcode is three bytes.
+    OP_WIDE,
+
+    // Not an instruction: the number of opcodes above.
+    OP_COUNT,
 } OpCode;
 
+// OP_CLOSURE is followed by a flags byte and an index for each variable the
+// function captures.
+#define CAPTURE_LOCAL 1    // A local of the enclosing function, else one of
+                           // its captures.
+#define CAPTURE_BY_VALUE 2 // Copied into ObjClosure.captured.
+
 typedef struct
 {
     int count;
@@ -56,5 +120,13 @@ void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
 int getLine(Chunk* chunk, int instructionIdx);
+void truncateChunk(Chunk* chunk, int count);
+int instructionLength(Chunk* chunk, int offset);
+int jumpTarget(Chunk* chunk, int offset);
+int readWide(Chunk* chunk, int offset);
+int stackEffect(const uint8_t* code);
+int superinstruction(const uint8_t* last, uint8_t instruction,
+                     ValueArray* constants);
+int branchInstruction(uint8_t comparison, bool jumpIfTrue);
 
 #endif // !clox_chunk_h
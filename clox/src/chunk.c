@@ -3,6 +3,8 @@
 
 #include "chuck.h"
 #include "memory.h"
+#include "object.h"
+#include "vm.h"
 
 void initChunk(Chunk *chunk) {
   chunk->count = 0;
@@ -35,7 +37,7 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
         GROW_ARRAY(int, chunk->lines, oldLinesCapacity, chunk->linesCapacity);
   }
 
-  if (chunk->lines[chunk->linesCount - 2] == line) {
+  if (chunk->linesCount > 0 && chunk->lines[chunk->linesCount - 2] == line) {
     chunk->lines[chunk->linesCount - 1]++;
   } else {
     chunk->lines[chunk->linesCount] = line;
@@ -52,10 +54,23 @@ void freeChunk(Chunk *chunk) {
 }
 
 int addConstant(Chunk *chunk, Value value) {
+  // Growing the array can collect, and the value may not be reachable yet.
+  push(value);
   writeValueArray(&chunk->constants, value);
+  pop();
   return chunk->constants.count - 1;
 }
 
+// Drops the code after the first `count` bytes, along with its line info.
+void truncateChunk(Chunk *chunk, int count) {
+  while (chunk->count > count) {
+    chunk->count--;
+    if (--chunk->lines[chunk->linesCount - 1] == 0) {
+      chunk->linesCount -= 2;
+    }
+  }
+}
+
 int getLine(Chunk *chunk, int instructionIdx) {
   int lineIdx = -2;
   int line = chunk->lines[0];
@@ -75,3 +90,223 @@ int getLine(Chunk *chunk, int instructionIdx) {
   } while (!isLine);
   return chunk->lines[lineIdx];
 }
+
+// Reads the three-byte operand of an OP_WIDE instruction.
+int readWide(Chunk *chunk, int offset) {
+  uint8_t *code = &chunk->code[offset];
+  return (code[0] << 16) | (code[1] << 8) | code[2];
+}
+
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_CAPTURED:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_PEEK:
+  case OP_INLINE_RETURN:
+  case OP_SET_LOCAL_POP:
+  case OP_ADD_CONSTANT:
+  case OP_SUBTRACT_CONSTANT:
+  case OP_MULTIPLY_CONSTANT:
+  case OP_DIVIDE_CONSTANT:
+    return 2;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_POP:
+  case OP_GET_LOCAL_2:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP:
+  case OP_LOOP:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_LESS:
+  case OP_JUMP_IF_GREATER:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_TRUE:
+    return 3;
+  case OP_INLINE_GUARD:
+    return 4;
+  case OP_CLOSURE: {
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + 2 * (function->upvalueCount + function->capturedCount);
+  }
+  case OP_WIDE:
+    if (chunk->code[offset + 1] == OP_CLOSURE) {
+      ObjFunction *function =
+          AS_FUNCTION(chunk->constants.values[readWide(chunk, offset + 2)]);
+      return 5 + 4 * (function->upvalueCount + function->capturedCount);
+    }
+    return 5;
+  default:
+    return 1;
+  }
+}
+
+// Returns the offset the jump at `offset` lands on, or -1 if the
+// instruction there isn't a jump.
+int jumpTarget(Chunk *chunk, int offset) {
+  uint8_t *code = &chunk->code[offset];
+  if (code[0] == OP_WIDE) {
+    switch (code[1]) {
+    case OP_LOOP:
+      return offset + 5 - readWide(chunk, offset + 2);
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+      return offset + 5 + readWide(chunk, offset + 2);
+    default:
+      return -1;
+    }
+  }
+
+  switch (code[0]) {
+  case OP_LOOP:
+    return offset + 3 - ((code[1] << 8) | code[2]);
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_LESS:
+  case OP_JUMP_IF_GREATER:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_TRUE:
+    return offset + 3 + ((code[1] << 8) | code[2]);
+  case OP_INLINE_GUARD:
+    return offset + 4 + ((code[1] << 8) | code[2]);
+  default:
+    return -1;
+  }
+}
+
+// How many values the instruction at `code` leaves on the stack, minus how
+// many it takes off. No instruction goes deeper than the larger of the
+// depths before and after it.
+int stackEffect(const uint8_t *code) {
+  switch (code[0]) {
+  case OP_WIDE:
+    // None of the widened instructions reads its operand here.
+    return stackEffect(code + 1);
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_GET_CAPTURED:
+  case OP_CLOSURE:
+  case OP_PEEK:
+    return 1;
+  case OP_GET_LOCAL_2:
+    return 2;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_INLINE_RETURN:
+    return -code[1];
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+  case OP_NOT_EQUAL:
+  case OP_GREATER_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_RETURN:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_CLOSE_UPVALUE:
+  case OP_SET_LOCAL_POP:
+  case OP_SET_GLOBAL_POP:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_TRUE:
+    return -1;
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_LESS:
+  case OP_JUMP_IF_GREATER:
+    return -2;
+  default:
+    return 0;
+  }
+}
+
+// Picks the superinstruction that replaces the instruction at `last`
+// followed by `instruction`, or returns -1 when the pair doesn't fuse. The
+// pairs are the most frequent ones measured over the bench/ scripts.
+int superinstruction(const uint8_t *last, uint8_t instruction,
+                     ValueArray *constants) {
+  switch (instruction) {
+  case OP_POP:
+    if (last[0] == OP_SET_LOCAL) return OP_SET_LOCAL_POP;
+    if (last[0] == OP_SET_GLOBAL) return OP_SET_GLOBAL_POP;
+    return -1;
+  case OP_GET_LOCAL:
+    return last[0] == OP_GET_LOCAL ? OP_GET_LOCAL_2 : -1;
+  case OP_NOT:
+    if (last[0] == OP_EQUAL) return OP_NOT_EQUAL;
+    if (last[0] == OP_LESS) return OP_GREATER_EQUAL;
+    if (last[0] == OP_GREATER) return OP_LESS_EQUAL;
+    return -1;
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+    if (last[0] != OP_CONSTANT || !IS_NUMBER(constants->values[last[1]])) {
+      return -1;
+    }
+    switch (instruction) {
+    case OP_ADD: return OP_ADD_CONSTANT;
+    case OP_SUBTRACT: return OP_SUBTRACT_CONSTANT;
+    case OP_MULTIPLY: return OP_MULTIPLY_CONSTANT;
+    default: return OP_DIVIDE_CONSTANT;
+    }
+  default:
+    return -1;
+  }
+}
+
+// Picks the branch that pops the operands of `comparison` and jumps when the
+// comparison comes out as `jumpIfTrue`, or returns -1 if `comparison` isn't
+// one. >= and <= branch on the < and > results so NaN behaves the same.
+int branchInstruction(uint8_t comparison, bool jumpIfTrue) {
+  switch (comparison) {
+  case OP_LESS:
+    return jumpIfTrue ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS;
+  case OP_GREATER:
+    return jumpIfTrue ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER;
+  case OP_EQUAL:
+    return jumpIfTrue ? OP_JUMP_IF_EQUAL : OP_JUMP_IF_NOT_EQUAL;
+  case OP_NOT_EQUAL:
+    return jumpIfTrue ? OP_JUMP_IF_NOT_EQUAL : OP_JUMP_IF_EQUAL;
+  case OP_GREATER_EQUAL:
+    return jumpIfTrue ? OP_JUMP_IF_NOT_LESS : OP_JUMP_IF_LESS;
+  case OP_LESS_EQUAL:
+    return jumpIfTrue ? OP_JUMP_IF_NOT_GREATER : OP_JUMP_IF_GREATER;
+  default:
+    return -1;
+  }
+}
@@ -12,5 +12,15 @@
 #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+// Operands of OP_WIDE instructions are three bytes.
+#define UINT24_MAX 0xffffff
+#define UINT24_COUNT (UINT24_MAX + 1)
+
+// Dispatch through a table of label addresses ("labels as values") when the
+// compiler supports it. Configure with -DCLOX_COMPUTED_GOTO=OFF to force the
+// portable switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(CLOX_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 #endif // !clox_common_h
@@ -10,6 +10,7 @@
 
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
 
@@ -58,8 +59,12 @@ typedef struct
 
 typedef struct
 {
-    uint8_t index;
+    int index;
     bool isLocal;
+    bool byValue;
+    // Index into the closure's upvalues, or into its captured values when
+    // byValue is set.
+    int slot;
 } Upvalue;
 
 typedef enum
@@ -74,16 +79,60 @@ typedef struct Compiler
     ObjFunction* function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    // Grown as needed: a function can have up to UINT24_COUNT of each.
+    Local* locals;
     int localCount;
-    Upvalue upvalues[UINT8_COUNT];
+    int localCapacity;
+    Upvalue* upvalues;
+    int upvalueCount;
+    int upvalueCapacity;
     int scopeDepth;
+
+    // An open-addressed set of indexes into the chunk's constants, so each
+    // distinct constant is added once. Empty slots hold -1. Constants from
+    // `unsharedFrom` up are each loaded by a single instruction.
+    int* constantSlots;
+    int constantSlotCount;
+    int constantSlotCapacity;
+    int unsharedFrom;
+
+    // Offsets of the last two instructions emitted (-1 when unknown), and
+    // the latest offset a jump or loop lands on. Instructions are only fused
+    // or folded together when no jump targets a boundary between them.
+    int lastInstruction;
+    int previousInstruction;
+    int lastTarget;
 } Compiler;
 
 Parser parser;
 
 Compiler* current = NULL;
 
+// The optimizer passes to run over each function as it is finished.
+static int optimizerPasses = PASSES_NONE;
+
+// Whether top-level function bodies are only checked for syntax errors,
+// and compiled when the function is first called.
+static bool lazyCompilation = false;
+
+// Forward jumps are emitted before their distance is known. They start out
+// with two-byte operands; when one doesn't fit, the whole script is compiled
+// again with every forward jump wide.
+static bool wideJumps = false;
+static bool jumpTooFar = false;
+
+// Every name that is assigned to somewhere in the source. A captured
+// variable whose name isn't here keeps the value it had when it was
+// captured, so closures copy it instead of sharing it through an
+// ObjUpvalue.
+static Table assignedNames;
+
+// Top-level functions small enough to inline, by name. A call through a
+// global of that name gets a copy of the function's body in place of the
+// call, behind a guard that falls back to calling whatever the global holds
+// at run time.
+static Table inlineCandidates;
+
 static Chunk* currentChunk() { return &current->function->chunk; }
 
 static void errorAt(Token* token, const char* message)
@@ -159,26 +208,113 @@ static void emitByte(uint8_t byte)
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+// Starts a new instruction. If it fuses with the previous one, the previous
+// opcode is rewritten in place and any operands of `instruction` that the
+// caller emits next are appended to the fused instruction.
+static void emitOp(uint8_t instruction)
 {
-    emitByte(byte1);
-    emitByte(byte2);
+    Chunk* chunk = currentChunk();
+    if (current->lastInstruction != -1 && current->lastTarget != chunk->count)
+    {
+        uint8_t* last = &chunk->code[current->lastInstruction];
+        int fused = superinstruction(last, instruction, &chunk->constants);
+        if (fused != -1)
+        {
+            last[0] = (uint8_t)fused;
+            return;
+        }
+    }
+
+    current->previousInstruction = current->lastInstruction;
+    current->lastInstruction = chunk->count;
+    emitByte(instruction);
 }
 
-static void emitLoop(int loopStart)
+// Records that a jump or loop lands on the next instruction emitted.
+static int markTarget()
+{
+    current->lastTarget = currentChunk()->count;
+    return current->lastTarget;
+}
+
+static void emitBytes(uint8_t instruction, uint8_t operand)
+{
+    emitOp(instruction);
+    emitByte(operand);
+}
+
+static void emitShort(uint8_t instruction, uint16_t operand)
+{
+    emitOp(instruction);
+    emitByte((operand >> 8) & 0xff);
+    emitByte(operand & 0xff);
+}
+
+static void emitWideOperand(int operand)
+{
+    emitByte((operand >> 16) & 0xff);
+    emitByte((operand >> 8) & 0xff);
+    emitByte(operand & 0xff);
+}
+
+static void emitWide(uint8_t instruction, int operand)
+{
+    emitOp(OP_WIDE);
+    emitByte(instruction);
+    emitWideOperand(operand);
+}
+
+// Emits an instruction with a one-byte operand, or its OP_WIDE form when
+// the operand doesn't fit.
+static void emitOperand(uint8_t instruction, int operand)
+{
+    if (operand > UINT8_MAX)
+    {
+        emitWide(instruction, operand);
+    }
+    else
+    {
+        emitBytes(instruction, (uint8_t)operand);
+    }
+}
+
+static void emitGlobal(uint8_t instruction, int slot)
 {
-    emitByte(OP_LOOP);
+    if (slot > UINT16_MAX)
+    {
+        emitWide(instruction, slot);
+    }
+    else
+    {
+        emitShort(instruction, (uint16_t)slot);
+    }
+}
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+static void emitLoop(int loopStart)
+{
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset > UINT16_MAX)
+    {
+        offset += 2;
+        if (offset > UINT24_MAX) error("Loop body too large.");
+        emitWide(OP_LOOP, offset);
+        return;
+    }
 
+    emitOp(OP_LOOP);
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
 }
 
 static int emitJump(uint8_t instruction)
 {
-    emitByte(instruction);
+    if (wideJumps)
+    {
+        emitWide(instruction, UINT24_MAX);
+        return currentChunk()->count - 3;
+    }
+
+    emitOp(instruction);
     emitByte(0xff);
     emitByte(0xff);
     return currentChunk()->count - 2;
@@ -186,77 +322,425 @@ static int emitJump(uint8_t instruction)
 
 static void emitReturn()
 {
-    emitByte(OP_NIL);
-    emitByte(OP_RETURN);
+    emitOp(OP_NIL);
+    emitOp(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value)
+// The slot holding the index of a constant identical to `value`, or the
+// empty slot where its index belongs. Slots left behind by constants that
+// dropLastInstruction removed may point past the pool or at a newer value,
+// so every candidate is checked against the pool itself.
+static int* findConstantSlot(int* slots, int capacity, Value value)
 {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX)
+    ValueArray* constants = &currentChunk()->constants;
+    uint32_t index = hashValue(value) & (capacity - 1);
+    for (;;)
+    {
+        int* slot = &slots[index];
+        if (*slot == -1) return slot;
+        if (*slot < constants->count &&
+            valuesIdentical(constants->values[*slot], value))
+        {
+            return slot;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growConstantSlots()
+{
+    int capacity = GROW_CAPACITY(current->constantSlotCapacity);
+    int* slots = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; i++) slots[i] = -1;
+
+    ValueArray* constants = &currentChunk()->constants;
+    current->constantSlotCount = 0;
+    for (int i = 0; i < constants->count; i++)
+    {
+        int* slot = findConstantSlot(slots, capacity, constants->values[i]);
+        if (*slot != -1) continue;
+        *slot = i;
+        current->constantSlotCount++;
+    }
+
+    FREE_ARRAY(int, current->constantSlots, current->constantSlotCapacity);
+    current->constantSlots = slots;
+    current->constantSlotCapacity = capacity;
+}
+
+static int makeConstant(Value value)
+{
+    // Growing the set can collect garbage, and `value` may be a string
+    // nothing else references yet.
+    push(value);
+    if (current->constantSlotCount + 1 > current->constantSlotCapacity * 3 / 4)
+    {
+        growConstantSlots();
+    }
+
+    int* slot = findConstantSlot(current->constantSlots,
+                                 current->constantSlotCapacity, value);
+    int constant = *slot;
+    if (constant != -1)
+    {
+        if (constant >= current->unsharedFrom)
+        {
+            current->unsharedFrom = constant + 1;
+        }
+    }
+    else
+    {
+        constant = addConstant(currentChunk(), value);
+        writeBarrier((Obj*)current->function, value);
+        *slot = constant;
+        current->constantSlotCount++;
+    }
+    pop();
+
+    if (constant > UINT24_MAX)
     {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
 static void emitConstant(Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitOperand(OP_CONSTANT, makeConstant(value));
 }
 
-static void patchJump(int offset)
+// Whether the last `count` instructions (one or two) can be rewritten: they
+// are known, and no jump lands inside them or right after them.
+static bool canRewrite(int count)
 {
-    // -2 to adjust for the bytecode for the jump offset itself
-    int jump = currentChunk()->count - offset - 2;
+    int first = count == 1 ? current->lastInstruction
+                           : current->previousInstruction;
+    return first != -1 && current->lastTarget <= first;
+}
+
+// The constant pool index the instruction at `offset` loads, or -1.
+static int constantIndex(int offset)
+{
+    Chunk* chunk = currentChunk();
+    if (chunk->code[offset] == OP_CONSTANT) return chunk->code[offset + 1];
+    if (chunk->code[offset] == OP_WIDE && chunk->code[offset + 1] == OP_CONSTANT)
+    {
+        return readWide(chunk, offset + 2);
+    }
+    return -1;
+}
+
+// Removes the last instruction emitted, along with its constant when that
+// is the newest one in the pool and no other instruction loads it.
+static void dropLastInstruction()
+{
+    Chunk* chunk = currentChunk();
+    int constant = constantIndex(current->lastInstruction);
+    if (constant != -1 && constant == chunk->constants.count - 1 &&
+        constant >= current->unsharedFrom)
+    {
+        chunk->constants.count--;
+    }
+
+    truncateChunk(chunk, current->lastInstruction);
+    current->lastInstruction = current->previousInstruction;
+    current->previousInstruction = -1;
+}
+
+// Reads the value pushed by the instruction at `offset`, if it pushes a
+// constant.
+static bool constantValue(int offset, Value* value)
+{
+    Chunk* chunk = currentChunk();
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_WIDE:
+        if (constantIndex(offset) == -1) return false;
+        *value = chunk->constants.values[constantIndex(offset)];
+        return true;
+    case OP_NIL:
+        *value = NIL_VAL;
+        return true;
+    case OP_TRUE:
+        *value = BOOL_VAL(true);
+        return true;
+    case OP_FALSE:
+        *value = BOOL_VAL(false);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void emitValue(Value value)
+{
+    if (IS_NIL(value))
+    {
+        emitOp(OP_NIL);
+    }
+    else if (IS_BOOL(value))
+    {
+        emitOp(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else
+    {
+        emitConstant(value);
+    }
+}
+
+// Replaces an operator over two constant operands with its result. The
+// operator is left alone when the VM would reject the operands, so the
+// error still happens at runtime.
+static bool foldBinary(uint8_t instruction)
+{
+    Value a, b, result;
+    if (!canRewrite(2) ||
+        !constantValue(current->previousInstruction, &a) ||
+        !constantValue(current->lastInstruction, &b) ||
+        !evaluateBinary(instruction, a, b, &result))
+    {
+        return false;
+    }
+
+    dropLastInstruction();
+    dropLastInstruction();
+    emitValue(result);
+    return true;
+}
+
+static bool foldUnary(uint8_t instruction)
+{
+    Value value, result;
+    if (!canRewrite(1) ||
+        !constantValue(current->lastInstruction, &value) ||
+        !evaluateUnary(instruction, value, &result))
+    {
+        return false;
+    }
+
+    dropLastInstruction();
+    emitValue(result);
+    return true;
+}
+
+// Emits the jump taken when the condition just compiled is false, or returns
+// -1 when the condition is a constant that never fails. The jump pops the
+// condition, so neither branch needs an OP_POP. Leading `!`s flip the sense
+// of the jump, and a trailing comparison is folded into it.
+static int emitConditionJump()
+{
+    Chunk* chunk = currentChunk();
+    bool jumpIfTrue = false;
+    while (canRewrite(1) && chunk->code[current->lastInstruction] == OP_NOT)
+    {
+        dropLastInstruction();
+        jumpIfTrue = !jumpIfTrue;
+    }
+
+    if (!canRewrite(1))
+    {
+        return emitJump(jumpIfTrue ? OP_POP_JUMP_IF_TRUE : OP_POP_JUMP_IF_FALSE);
+    }
 
-    if (jump > UINT16_MAX)
+    Value constant, negated;
+    if (constantValue(current->lastInstruction, &constant) &&
+        evaluateUnary(OP_NOT, constant, &negated))
     {
-        error("Too much code to jump over.");
+        dropLastInstruction();
+        if (AS_BOOL(negated) == jumpIfTrue) return -1;
+        return emitJump(OP_JUMP);
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    int branch = branchInstruction(chunk->code[current->lastInstruction],
+                                   jumpIfTrue);
+    // The fused branches have no wide forms.
+    if (branch == -1 || wideJumps)
+    {
+        return emitJump(jumpIfTrue ? OP_POP_JUMP_IF_TRUE : OP_POP_JUMP_IF_FALSE);
+    }
+
+    dropLastInstruction();
+    return emitJump((uint8_t)branch);
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type)
+static void patchJump(int offset)
+{
+    Chunk* chunk = currentChunk();
+    if (wideJumps)
+    {
+        int jump = chunk->count - offset - 3;
+        if (jump > UINT24_MAX) error("Too much code to jump over.");
+
+        chunk->code[offset] = (jump >> 16) & 0xff;
+        chunk->code[offset + 1] = (jump >> 8) & 0xff;
+        chunk->code[offset + 2] = jump & 0xff;
+        markTarget();
+        return;
+    }
+
+    // -2 to adjust for the bytecode for the jump offset itself
+    int jump = chunk->count - offset - 2;
+
+    if (jump > UINT16_MAX) jumpTooFar = true;
+
+    chunk->code[offset] = (jump >> 8) & 0xff;
+    chunk->code[offset + 1] = jump & 0xff;
+    markTarget();
+}
+
+static void addLocal(const Token name);
+
+// Starts compiling into `function`, or into a new function when it is
+// NULL.
+static void initCompiler(Compiler* compiler, FunctionType type,
+                         ObjFunction* function)
 {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCount = 0;
+    compiler->upvalueCapacity = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
+    compiler->constantSlots = NULL;
+    compiler->constantSlotCount = 0;
+    compiler->constantSlotCapacity = 0;
+    compiler->unsharedFrom = 0;
+    compiler->lastInstruction = -1;
+    compiler->previousInstruction = -1;
+    compiler->lastTarget = 0;
+    compiler->function = function != NULL ? function : newFunction();
     current = compiler;
 
-    if (type != TYPE_SCRIPT)
+    if (type != TYPE_SCRIPT && function == NULL)
     {
         current->function->name = copyString(parser.previous.start,
                                              parser.previous.length);
+        writeBarrier((Obj*)current->function,
+                     OBJ_VAL(current->function->name));
     }
 
-    Local* local = &current->locals[current->localCount++];
-    local->depth = 0;
-    local->isCaptured = false;
-    local->name.start = "";
-    local->name.length = 0;
+    Token name;
+    name.start = "";
+    name.length = 0;
+    addLocal(name);
+    current->locals[0].depth = 0;
+}
+
+// Follows every path through the chunk to find the deepest the stack gets,
+// starting from the callee and its arguments. The compiler only emits jumps
+// to places every path reaches at the same depth, so each offset is walked
+// once.
+static int maxStackDepth(Chunk* chunk, int arity)
+{
+    int* depths = ALLOCATE(int, chunk->count);
+    int* pending = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+    int maxDepth = arity + 1;
+    int pendingCount = 0;
+    depths[0] = maxDepth;
+    pending[pendingCount++] = 0;
+
+    while (pendingCount > 0)
+    {
+        int offset = pending[--pendingCount];
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_WIDE) instruction = chunk->code[offset + 1];
+        int depth = depths[offset] + stackEffect(&chunk->code[offset]);
+        if (depth > maxDepth) maxDepth = depth;
+
+        int next = offset + instructionLength(chunk, offset);
+        int successors[2];
+        int successorCount = 0;
+        switch (instruction)
+        {
+        case OP_RETURN:
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            successors[successorCount++] = jumpTarget(chunk, offset);
+            break;
+        default:
+            successors[successorCount++] = next;
+            if (jumpTarget(chunk, offset) != -1)
+            {
+                successors[successorCount++] = jumpTarget(chunk, offset);
+            }
+            break;
+        }
+
+        for (int i = 0; i < successorCount; i++)
+        {
+            int successor = successors[i];
+            if (successor >= chunk->count || depths[successor] != -1)
+                continue;
+            depths[successor] = depth;
+            pending[pendingCount++] = successor;
+        }
+    }
+
+    FREE_ARRAY(int, depths, chunk->count);
+    FREE_ARRAY(int, pending, chunk->count);
+    return maxDepth;
 }
 
+#ifdef DEBUG_PRINT_CODE
+static int countInstructions(Chunk* chunk)
+{
+    int count = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        count++;
+    }
+    return count;
+}
+#endif
+
 static ObjFunction* endCompiler()
 {
     emitReturn();
     ObjFunction* function = current->function;
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
+    int bytesBefore = function->chunk.count;
+    int instructionsBefore = countInstructions(&function->chunk);
+#endif
+
+    // A jump that didn't fit is garbage; the script is compiled again.
+    bool finished = !parser.hadError && !jumpTooFar;
+    if (finished)
+    {
+        if (optimizerPasses & ~(PASS_PEEPHOLE | PASS_INLINE))
+        {
+            optimizeFunction(function, optimizerPasses);
+        }
+        if (optimizerPasses & PASS_PEEPHOLE)
+        {
+            peephole(&function->chunk);
+        }
+        function->maxStack = maxStackDepth(&function->chunk, function->arity);
+    }
+#ifdef DEBUG_PRINT_CODE
+    if (finished)
     {
         disassembleChunk(currentChunk(),
                          function->name != NULL ? function->name->chars : "<script>");
+        printf("-- optimized: %d bytes saved, %d instructions removed\n",
+               bytesBefore - function->chunk.count,
+               instructionsBefore - countInstructions(&function->chunk));
     }
 
 #endif /* ifndef DEBUG_PRINT_CODE */
 
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
+    FREE_ARRAY(int, current->constantSlots, current->constantSlotCapacity);
     current = current->enclosing;
     return function;
 }
@@ -275,11 +759,11 @@ static void endScope()
     {
         if (current->locals[current->localCount - 1].isCaptured)
         {
-            emitByte(OP_CLOSE_UPVALUE);
+            emitOp(OP_CLOSE_UPVALUE);
         }
         else
         {
-            emitByte(OP_POP);
+            emitOp(OP_POP);
         }
         current->localCount--;
     }
@@ -291,9 +775,16 @@ static void statement();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(const Token* name)
+static int identifierGlobal(const Token* name)
 {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT24_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
 }
 
 static bool identifierEqual(Token* a, Token* b)
@@ -319,56 +810,90 @@ static int resolveLocal(Compiler* compiler, Token* name)
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+static bool isAssigned(Token* name)
+{
+    Value unused;
+    return tableGet(&assignedNames, copyString(name->start, name->length),
+                    &unused);
+}
+
+static int addUpvalue(Compiler* compiler, int index, bool isLocal,
+                      bool byValue)
 {
-    int upvalueCount = compiler->function->upvalueCount;
+    int upvalueCount = compiler->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++)
     {
         Upvalue* upvalue = &compiler->upvalues[i];
         if (upvalue->index == index && upvalue->isLocal == isLocal)
         {
-            return i;
+            return upvalue->slot;
         }
     }
 
-    if (upvalueCount == UINT8_COUNT)
+    if (upvalueCount == UINT24_COUNT)
     {
         error("Too many closure variables in function.");
         return 0;
     }
 
-    compiler->upvalues[upvalueCount].isLocal = isLocal;
-    compiler->upvalues[upvalueCount].index = index;
-    return compiler->function->upvalueCount++;
+    if (compiler->upvalueCapacity < upvalueCount + 1)
+    {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues,
+                                        oldCapacity, compiler->upvalueCapacity);
+    }
+
+    Upvalue* upvalue = &compiler->upvalues[compiler->upvalueCount++];
+    upvalue->isLocal = isLocal;
+    upvalue->index = index;
+    upvalue->byValue = byValue;
+    upvalue->slot = byValue ? compiler->function->capturedCount++
+                            : compiler->function->upvalueCount++;
+    return upvalue->slot;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name)
+// Sets `byValue` when the variable is never assigned, and so is captured
+// by value all the way down.
+static int resolveUpvalue(Compiler* compiler, Token* name, bool* byValue)
 {
     if (compiler->enclosing == NULL) return -1;
 
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1)
     {
-        compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        *byValue = !isAssigned(name);
+        if (!*byValue)
+        {
+            compiler->enclosing->locals[local].isCaptured = true;
+        }
+        return addUpvalue(compiler, local, true, *byValue);
     }
 
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(compiler->enclosing, name, byValue);
     if (upvalue != -1)
     {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, upvalue, false, *byValue);
     }
     return -1;
 }
 
 static void addLocal(const Token name)
 {
-    if (current->localCount == UINT8_COUNT)
+    if (current->localCount == UINT24_COUNT)
     {
         error("Too many local variables in function.");
         return;
     }
+
+    if (current->localCapacity < current->localCount + 1)
+    {
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local, current->locals, oldCapacity,
+                                     current->localCapacity);
+    }
     Local* local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1;
@@ -398,14 +923,14 @@ static void declareVariable()
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage)
+static int parseVariable(const char* errorMessage)
 {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierGlobal(&parser.previous);
 }
 
 static void markInitialized()
@@ -414,21 +939,21 @@ static void markInitialized()
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(int global)
 {
     if (current->scopeDepth > 0)
     {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 static void and_(bool canAssign)
 {
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     parsePrecedence(PREC_AND);
 
     patchJump(endJump);
@@ -441,7 +966,7 @@ static void or_(bool canAssign)
     int endJump = emitJump(OP_JUMP);
 
     patchJump(elseJump);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 
     parsePrecedence(PREC_OR);
     patchJump(endJump);
@@ -454,41 +979,44 @@ static void binary(bool canAssign)
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    uint8_t instruction;
     switch (operatorType)
     {
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+        instruction = OP_ADD;
         break;
     case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
+        instruction = OP_SUBTRACT;
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        instruction = OP_MULTIPLY;
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        instruction = OP_DIVIDE;
         break;
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        instruction = OP_NOT_EQUAL;
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        instruction = OP_EQUAL;
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        instruction = OP_GREATER;
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        instruction = OP_GREATER_EQUAL;
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        instruction = OP_LESS;
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        instruction = OP_LESS_EQUAL;
         break;
     default:
         return;
     }
+
+    if (!foldBinary(instruction)) emitOp(instruction);
 }
 
 static uint8_t argumentList()
@@ -513,9 +1041,196 @@ static uint8_t argumentList()
     return argCount;
 }
 
+// Functions with more bytecode than this before their return aren't
+// inlined.
+#define INLINE_MAX_LENGTH 32
+
+// Whether `function` can be copied into its callers: it reaches its return
+// through straight-line code that reads only its own stack slots, globals
+// and constants. Since it calls nothing, it can't recurse.
+static bool inlinable(ObjFunction* function)
+{
+    if (function->upvalueCount > 0 || function->capturedCount > 0)
+        return false;
+
+    Chunk* chunk = &function->chunk;
+    int depth = function->arity + 1;
+    for (int offset = 0; offset < chunk->count && offset < INLINE_MAX_LENGTH;
+         offset += instructionLength(chunk, offset))
+    {
+        uint8_t* code = &chunk->code[offset];
+        switch (code[0])
+        {
+        case OP_RETURN:
+            return depth - 1 <= UINT8_MAX;
+        case OP_GET_LOCAL:
+            if (depth - 1 - code[1] > UINT8_MAX) return false;
+            break;
+        case OP_GET_LOCAL_2:
+            if (depth - 1 - code[1] > UINT8_MAX) return false;
+            if (depth - code[2] > UINT8_MAX) return false;
+            break;
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_MULTIPLY_CONSTANT:
+        case OP_DIVIDE_CONSTANT:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            break;
+        default:
+            return false;
+        }
+        depth += stackEffect(code);
+    }
+    return false;
+}
+
+// Emits the body of an inlinable function with its reads of stack slots
+// turned into OP_PEEKs below the caller's stack top, where the callee and
+// arguments are. The copy keeps the callee's line numbers.
+static void inlineBody(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    int callLine = parser.previous.line;
+    int depth = function->arity + 1;
+    for (int offset = 0;; offset += instructionLength(chunk, offset))
+    {
+        uint8_t* code = &chunk->code[offset];
+        Value* constants = chunk->constants.values;
+        parser.previous.line = getLine(chunk, offset);
+        switch (code[0])
+        {
+        case OP_RETURN:
+            emitBytes(OP_INLINE_RETURN, (uint8_t)(depth - 1));
+            parser.previous.line = callLine;
+            return;
+        case OP_CONSTANT:
+            emitConstant(constants[code[1]]);
+            break;
+        case OP_GET_LOCAL:
+            emitBytes(OP_PEEK, (uint8_t)(depth - 1 - code[1]));
+            break;
+        case OP_GET_LOCAL_2:
+            emitBytes(OP_PEEK, (uint8_t)(depth - 1 - code[1]));
+            emitBytes(OP_PEEK, (uint8_t)(depth - code[2]));
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            emitGlobal(code[0], (code[1] << 8) | code[2]);
+            break;
+        case OP_SET_GLOBAL_POP:
+            emitGlobal(OP_SET_GLOBAL, (code[1] << 8) | code[2]);
+            emitOp(OP_POP);
+            break;
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_MULTIPLY_CONSTANT:
+        case OP_DIVIDE_CONSTANT:
+            emitConstant(constants[code[1]]);
+            emitOp(code[0] == OP_ADD_CONSTANT ? OP_ADD
+                   : code[0] == OP_SUBTRACT_CONSTANT ? OP_SUBTRACT
+                   : code[0] == OP_MULTIPLY_CONSTANT ? OP_MULTIPLY
+                   : OP_DIVIDE);
+            break;
+        case OP_NOT_EQUAL:
+            emitOp(OP_EQUAL);
+            emitOp(OP_NOT);
+            break;
+        case OP_GREATER_EQUAL:
+            emitOp(OP_LESS);
+            emitOp(OP_NOT);
+            break;
+        case OP_LESS_EQUAL:
+            emitOp(OP_GREATER);
+            emitOp(OP_NOT);
+            break;
+        default:
+            emitOp(code[0]);
+            break;
+        }
+        depth += stackEffect(code);
+    }
+}
+
+// The function to inline at a call whose callee was just compiled, if the
+// callee is a global named after one of the candidates.
+static ObjFunction* inlineCandidate()
+{
+    Chunk* chunk = currentChunk();
+    int callee = current->lastInstruction;
+    if (!(optimizerPasses & PASS_INLINE) || !canRewrite(1) ||
+        chunk->code[callee] != OP_GET_GLOBAL)
+    {
+        return NULL;
+    }
+
+    int slot = (chunk->code[callee + 1] << 8) | chunk->code[callee + 2];
+    Value function;
+    if (!tableGet(&inlineCandidates, AS_STRING(vm.globalNames.values[slot]),
+                  &function))
+    {
+        return NULL;
+    }
+    return AS_FUNCTION(function);
+}
+
+// Emits the guard, the inlined body, and the plain call the guard falls back
+// to.
+static void inlineCall(ObjFunction* function, uint8_t argCount)
+{
+    int constant = makeConstant(OBJ_VAL(function));
+    if (constant > UINT8_MAX)
+    {
+        emitBytes(OP_CALL, argCount);
+        return;
+    }
+
+    emitOp(OP_INLINE_GUARD);
+    emitByte(0xff);
+    emitByte(0xff);
+    emitByte((uint8_t)constant);
+    int guard = currentChunk()->count - 3;
+
+    inlineBody(function);
+    int done = emitJump(OP_JUMP);
+
+    Chunk* chunk = currentChunk();
+    int jump = chunk->count - guard - 3;
+    chunk->code[guard] = (jump >> 8) & 0xff;
+    chunk->code[guard + 1] = jump & 0xff;
+    markTarget();
+    emitBytes(OP_CALL, argCount);
+    patchJump(done);
+}
+
 static void call(bool canAssign)
 {
+    ObjFunction* inlined = inlineCandidate();
     uint8_t argCount = argumentList();
+    if (inlined != NULL && inlined->arity == argCount)
+    {
+        inlineCall(inlined, argCount);
+        return;
+    }
     emitBytes(OP_CALL, argCount);
 }
 
@@ -524,13 +1239,13 @@ static void literal(bool canAssign)
     switch (parser.previous.type)
     {
     case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+        emitOp(OP_FALSE);
         break;
     case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+        emitOp(OP_TRUE);
         break;
     case TOKEN_NIL:
-        emitByte(OP_NIL);
+        emitOp(OP_NIL);
         break;
     default:
         return;
@@ -558,32 +1273,41 @@ static void string(bool canAssign)
 static void namedVariable(Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
+    bool byValue;
     int arg = resolveLocal(current, &name);
     if (arg != -1)
     {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
     }
-    else if ((arg = resolveUpvalue(current, &name)) != -1)
+    else if ((arg = resolveUpvalue(current, &name, &byValue)) != -1)
     {
-        getOp = OP_GET_UPVALUE;
+        getOp = byValue ? OP_GET_CAPTURED : OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     }
     else
     {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        int global = identifierGlobal(&name);
+        if (canAssign && match(TOKEN_EQUAL))
+        {
+            expression();
+            emitGlobal(OP_SET_GLOBAL, global);
+        }
+        else
+        {
+            emitGlobal(OP_GET_GLOBAL, global);
+        }
+        return;
     }
 
     if (canAssign && match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitOperand(setOp, arg);
     }
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        emitOperand(getOp, arg);
     }
 }
 
@@ -598,17 +1322,20 @@ static void unary(bool canAssign)
 
     parsePrecedence(PREC_UNARY);
 
+    uint8_t instruction;
     switch (operatorType)
     {
     case TOKEN_BANG:
-        emitByte(OP_NOT);
+        instruction = OP_NOT;
         break;
     case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
+        instruction = OP_NEGATE;
         break;
     default:
         return;
     }
+
+    if (!foldUnary(instruction)) emitOp(instruction);
 }
 
 ParseRule rules[] = {
@@ -694,10 +1421,9 @@ static void block()
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+// Compiles a parameter list and body into the current function.
+static void functionBody()
 {
-    Compiler compiler;
-    initCompiler(&compiler, type);
     beginScope();
 
     // the parameter list
@@ -712,7 +1438,7 @@ static void function(FunctionType type)
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
 
-            uint8_t paramConstant = parseVariable("Expect parameter name.");
+            int paramConstant = parseVariable("Expect parameter name.");
             defineVariable(paramConstant);
         }
         while (match(TOKEN_COMMA));
@@ -722,29 +1448,329 @@ static void function(FunctionType type)
     // the body
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
+}
+
+static ObjFunction* function(FunctionType type)
+{
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    functionBody();
 
     // the function object
     ObjFunction* function = endCompiler(&compiler);
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    if (function->upvalueCount == 0 && function->capturedCount == 0)
+    {
+        push(OBJ_VAL(function));
+        function->closure = newClosure(function);
+        writeBarrier((Obj*)function, OBJ_VAL(function->closure));
+        pop();
+    }
+    int constant = makeConstant(OBJ_VAL(function));
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < compiler.upvalueCount; i++)
+    {
+        if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+    }
+
+    if (wide)
+    {
+        emitWide(OP_CLOSURE, constant);
+    }
+    else
+    {
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
+    }
+
+    for (int i = 0; i < compiler.upvalueCount; i++)
+    {
+        emitByte((compiler.upvalues[i].isLocal ? CAPTURE_LOCAL : 0) |
+                 (compiler.upvalues[i].byValue ? CAPTURE_BY_VALUE : 0));
+        if (wide)
+        {
+            emitWideOperand(compiler.upvalues[i].index);
+        }
+        else
+        {
+            emitByte((uint8_t)compiler.upvalues[i].index);
+        }
+    }
+    FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
+    return function;
+}
+
+// Syntax-only parsing for the bodies lazy compilation defers. These follow
+// the grammar of the compiling functions above and report the same syntax
+// errors, but emit nothing and resolve no names. Errors that need the
+// compiler, such as a local declared twice, wait for the first call.
+static void skimExpression();
+static void skimStatement();
+static void skimDeclaration();
+static void synchronize();
+
+static void skimArguments()
+{
+    if (!check(TOKEN_RIGHT_PAREN))
+    {
+        int argCount = 0;
+        do
+        {
+            skimExpression();
+            if (argCount == 255)
+            {
+                error("Can't have more than 255 arguments.");
+            }
+            argCount++;
+        }
+        while (match(TOKEN_COMMA));
+    }
+
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+}
+
+static void skimPrecedence(Precedence precedence)
+{
+    advance();
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    switch (parser.previous.type)
+    {
+    case TOKEN_LEFT_PAREN:
+        skimExpression();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
+        break;
+    case TOKEN_MINUS:
+    case TOKEN_BANG:
+        skimPrecedence(PREC_UNARY);
+        break;
+    case TOKEN_IDENTIFIER:
+        if (canAssign && match(TOKEN_EQUAL)) skimExpression();
+        break;
+    case TOKEN_STRING:
+    case TOKEN_NUMBER:
+    case TOKEN_FALSE:
+    case TOKEN_TRUE:
+    case TOKEN_NIL:
+        break;
+    default:
+        error("Expect expression.");
+        return;
+    }
+
+    while (precedence <= getRule(parser.current.type)->precedence)
+    {
+        advance();
+        TokenType operatorType = parser.previous.type;
+        if (operatorType == TOKEN_LEFT_PAREN)
+        {
+            skimArguments();
+        }
+        else if (operatorType == TOKEN_AND || operatorType == TOKEN_OR)
+        {
+            skimPrecedence(getRule(operatorType)->precedence);
+        }
+        else
+        {
+            skimPrecedence((Precedence)(getRule(operatorType)->precedence + 1));
+        }
+    }
+
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        error("Invalid assignment target.");
+    }
+}
+
+static void skimExpression() { skimPrecedence(PREC_ASSIGNMENT); }
+
+static void skimBlock()
+{
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    {
+        skimDeclaration();
+    }
+
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+// Returns the number of parameters.
+static int skimFunction()
+{
+    int arity = 0;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            arity++;
+            if (arity > 255)
+            {
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+        }
+        while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    skimBlock();
+    return arity;
+}
+
+static void skimVarDeclaration()
+{
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    if (match(TOKEN_EQUAL)) skimExpression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+}
+
+static void skimStatement()
+{
+    if (match(TOKEN_PRINT))
+    {
+        skimExpression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+    }
+    else if (match(TOKEN_IF))
+    {
+        consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+        skimExpression();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+        skimStatement();
+        if (match(TOKEN_ELSE)) skimStatement();
+    }
+    else if (match(TOKEN_RETURN))
+    {
+        if (!match(TOKEN_SEMICOLON))
+        {
+            skimExpression();
+            consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        }
+    }
+    else if (match(TOKEN_WHILE))
+    {
+        consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+        skimExpression();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+        skimStatement();
+    }
+    else if (match(TOKEN_FOR))
+    {
+        consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+        if (match(TOKEN_SEMICOLON))
+        {
+            // No initializer
+        }
+        else if (match(TOKEN_VAR))
+        {
+            skimVarDeclaration();
+        }
+        else
+        {
+            skimExpression();
+            consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+        }
+
+        if (!match(TOKEN_SEMICOLON))
+        {
+            skimExpression();
+            consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        }
+        if (!match(TOKEN_RIGHT_PAREN))
+        {
+            skimExpression();
+            consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        }
+        skimStatement();
+    }
+    else if (match(TOKEN_LEFT_BRACE))
+    {
+        skimBlock();
+    }
+    else
+    {
+        skimExpression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+    }
+}
 
-    for (int i = 0; i < function->upvalueCount; i++)
+static void skimDeclaration()
+{
+    if (match(TOKEN_FUN))
+    {
+        consume(TOKEN_IDENTIFIER, "Expect function name.");
+        skimFunction();
+    }
+    else if (match(TOKEN_VAR))
+    {
+        skimVarDeclaration();
+    }
+    else
     {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        skimStatement();
     }
+
+    if (parser.panicMode) synchronize();
+}
+
+// Skims a top-level function's parameters and body, and emits a closure for
+// a function that compiles them when it's first called. The body's source
+// is copied, since the script's is gone by then. A top-level function has
+// nothing to capture, so skipping the body doesn't hide any upvalues.
+static ObjFunction* lazyFunction()
+{
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    function->name = copyString(parser.previous.start, parser.previous.length);
+    writeBarrier((Obj*)function, OBJ_VAL(function->name));
+
+    const char* start = parser.current.start;
+    function->sourceLine = parser.current.line;
+    function->arity = skimFunction();
+    if (!parser.hadError)
+    {
+        const char* end = parser.previous.start + parser.previous.length;
+        function->source = copyString(start, (int)(end - start));
+        writeBarrier((Obj*)function, OBJ_VAL(function->source));
+    }
+
+    function->closure = newClosure(function);
+    writeBarrier((Obj*)function, OBJ_VAL(function->closure));
+    emitOperand(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    pop();
+    return function;
 }
 
 static void funDeclaration()
 {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
+    Token name = parser.previous;
     markInitialized();
-    function(TYPE_FUNCTION);
+    ObjFunction* compiled = lazyCompilation && current->scopeDepth == 0
+                                ? lazyFunction()
+                                : function(TYPE_FUNCTION);
     defineVariable(global);
+
+    // Only top-level declarations are globals. A later declaration of the
+    // same name that can't be inlined replaces the candidate.
+    if (current->scopeDepth == 0)
+    {
+        ObjString* key = copyString(name.start, name.length);
+        push(OBJ_VAL(key));
+        if (inlinable(compiled))
+        {
+            tableSet(&inlineCandidates, key, OBJ_VAL(compiled));
+        }
+        else
+        {
+            tableDelete(&inlineCandidates, key);
+        }
+        pop();
+    }
 }
 
 static void varDeclaration()
 {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL))
     {
@@ -752,7 +1778,7 @@ static void varDeclaration()
     }
     else
     {
-        emitByte(OP_NIL);
+        emitOp(OP_NIL);
     }
 
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
@@ -763,7 +1789,7 @@ static void printStatement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+    emitOp(OP_PRINT);
 }
 
 static void returnStatement()
@@ -781,7 +1807,18 @@ static void returnStatement()
     {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(OP_RETURN);
+
+        // `return f(...)`: the call can reuse this frame. A jump landing
+        // after the call means it isn't the only way out, as in
+        // `return a and f()`.
+        Chunk* chunk = currentChunk();
+        if (current->lastInstruction != -1 &&
+            current->lastTarget != chunk->count &&
+            chunk->code[current->lastInstruction] == OP_CALL)
+        {
+            chunk->code[current->lastInstruction] = OP_TAIL_CALL;
+        }
+        emitOp(OP_RETURN);
     }
 }
 
@@ -789,26 +1826,23 @@ static void expressionStatement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 }
 
 static void whileStatement()
 {
-    int loopStart = currentChunk()->count;
+    int loopStart = markTarget();
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-
-    emitByte(OP_POP);
+    int exitJump = emitConditionJump();
     statement();
 
     emitLoop(loopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    if (exitJump != -1) patchJump(exitJump);
 }
 
 static void forStatement()
@@ -829,7 +1863,7 @@ static void forStatement()
         expressionStatement();
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = markTarget();
 
     int exitJump = -1;
     if (!match(TOKEN_SEMICOLON))
@@ -838,34 +1872,54 @@ static void forStatement()
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Condition
+        exitJump = emitConditionJump();
     }
 
+    // The increment runs after the body but is parsed before it. Its code is
+    // cut out here and re-emitted after the body, so an iteration doesn't
+    // have to jump over the increment and back.
+    uint8_t* increment = NULL;
+    int* incrementLines = NULL;
+    int incrementLength = 0;
     if (!match(TOKEN_RIGHT_PAREN))
     {
-        int bodyJump = emitJump(OP_JUMP);
-
-        int incrementStart = currentChunk()->count;
+        Chunk* chunk = currentChunk();
+        int incrementStart = markTarget();
         expression();
-        emitByte(OP_POP);
+        emitOp(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emitLoop(loopStart);
-        loopStart = incrementStart;
-        patchJump(bodyJump);
+        incrementLength = chunk->count - incrementStart;
+        increment = ALLOCATE(uint8_t, incrementLength);
+        incrementLines = ALLOCATE(int, incrementLength);
+        for (int i = 0; i < incrementLength; i++)
+        {
+            increment[i] = chunk->code[incrementStart + i];
+            incrementLines[i] = getLine(chunk, incrementStart + i);
+        }
+        truncateChunk(chunk, incrementStart);
+        current->lastInstruction = -1;
+        current->previousInstruction = -1;
     }
 
     statement();
 
-    emitLoop(loopStart);
-
-    if (exitJump != -1)
+    if (increment != NULL)
     {
-        patchJump(exitJump);
-        emitByte(OP_POP);
+        for (int i = 0; i < incrementLength; i++)
+        {
+            writeChunk(currentChunk(), increment[i], incrementLines[i]);
+        }
+        current->lastInstruction = -1;
+        current->previousInstruction = -1;
+        FREE_ARRAY(uint8_t, increment, incrementLength);
+        FREE_ARRAY(int, incrementLines, incrementLength);
     }
 
+    emitLoop(loopStart);
+
+    if (exitJump != -1) patchJump(exitJump);
+
     endScope();
 }
 
@@ -920,17 +1974,20 @@ static void ifStatement()
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int thenJump = emitConditionJump();
     statement();
 
-    int elseJump = emitJump(OP_JUMP);
-
-    patchJump(thenJump);
-    emitByte(OP_POP);
-
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
+    if (match(TOKEN_ELSE))
+    {
+        int elseJump = emitJump(OP_JUMP);
+        if (thenJump != -1) patchJump(thenJump);
+        statement();
+        patchJump(elseJump);
+    }
+    else if (thenJump != -1)
+    {
+        patchJump(thenJump);
+    }
 }
 
 static void statement()
@@ -967,26 +2024,106 @@ static void statement()
     }
 }
 
-ObjFunction* compile(const char* source)
+// Scans ahead for `name =` outside of a declaration.
+static void findAssignedNames(const char* source)
 {
     initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    Token beforeLast = {0};
+    Token last = {0};
+    for (;;)
+    {
+        Token token = scanToken();
+        if (token.type == TOKEN_EOF) break;
 
-    parser.hadError = false;
-    parser.panicMode = false;
+        if (token.type == TOKEN_EQUAL && last.type == TOKEN_IDENTIFIER &&
+            beforeLast.type != TOKEN_VAR)
+        {
+            ObjString* name = copyString(last.start, last.length);
+            push(OBJ_VAL(name));
+            tableSet(&assignedNames, name, NIL_VAL);
+            pop();
+        }
+        beforeLast = last;
+        last = token;
+    }
+}
 
-    advance();
+ObjFunction* compile(const char* source, int passes, bool lazy)
+{
+    optimizerPasses = passes;
+    lazyCompilation = lazy;
+    wideJumps = false;
+    findAssignedNames(source);
 
-    while (!match(TOKEN_EOF))
+    ObjFunction* function;
+    for (;;)
     {
-        declaration();
+        initScanner(source);
+        freeTable(&inlineCandidates);
+        Compiler compiler;
+        initCompiler(&compiler, TYPE_SCRIPT, NULL);
+
+        parser.hadError = false;
+        parser.panicMode = false;
+        jumpTooFar = false;
+
+        advance();
+
+        while (!match(TOKEN_EOF))
+        {
+            declaration();
+        }
+
+        function = endCompiler();
+        if (jumpTooFar && !parser.hadError)
+        {
+            wideJumps = true;
+            continue;
+        }
+        break;
     }
 
-    ObjFunction* function = endCompiler();
+    freeTable(&assignedNames);
+    freeTable(&inlineCandidates);
     return parser.hadError ? NULL : function;
 }
 
+// Compiles a function lazy compilation deferred, from the source it kept.
+// Returns false after reporting any errors the skim couldn't catch; the
+// function is left to compile again on its next call.
+bool compileFunction(ObjFunction* function)
+{
+    findAssignedNames(function->source->chars);
+    wideJumps = false;
+    for (;;)
+    {
+        freeChunk(&function->chunk);
+        function->arity = 0;
+        initScannerAt(function->source->chars, function->sourceLine);
+        Compiler compiler;
+        initCompiler(&compiler, TYPE_FUNCTION, function);
+
+        parser.hadError = false;
+        parser.panicMode = false;
+        jumpTooFar = false;
+
+        advance();
+        functionBody();
+        endCompiler();
+        if (jumpTooFar && !parser.hadError)
+        {
+            wideJumps = true;
+            continue;
+        }
+        break;
+    }
+
+    freeTable(&assignedNames);
+    if (parser.hadError) return false;
+    function->source = NULL;
+    return true;
+}
+
 void markCompilerRoots()
 {
     Compiler* compiler = current;
@@ -995,4 +2132,6 @@ void markCompilerRoots()
         markObject((Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
+    markTable(&assignedNames);
+    markTable(&inlineCandidates);
 }
@@ -4,7 +4,8 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
+ObjFunction* compile(const char* source, int passes, bool lazy);
+bool compileFunction(ObjFunction* function);
 void markCompilerRoots();
 
 #endif // !clox_compiler_h
@@ -6,6 +6,7 @@
 
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int simpleInstruction(const char* name, int offset)
 {
@@ -20,6 +21,13 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset)
+{
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1],
+           chunk->code[offset + 2]);
+    return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -28,6 +36,17 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int guardInstruction(Chunk* chunk, int offset)
+{
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    uint8_t constant = chunk->code[offset + 3];
+    printf("%-16s %4d -> %d '", "OP_INLINE_GUARD", offset, offset + 4 + jump);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 static int constantInstruction(const char* name, Chunk* chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
@@ -37,6 +56,96 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+// Prints an instruction behind OP_WIDE, with its three-byte operand.
+static int wideInstruction(Chunk* chunk, int offset)
+{
+    uint8_t instruction = chunk->code[offset + 1];
+    int operand = readWide(chunk, offset + 2);
+    printf("OP_WIDE ");
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+        printf("%-16s %4d '", "OP_CONSTANT", operand);
+        printValue(chunk->constants.values[operand]);
+        printf("'\n");
+        return offset + 5;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+        printf("%-16s %4d '",
+               instruction == OP_DEFINE_GLOBAL ? "OP_DEFINE_GLOBAL"
+               : instruction == OP_GET_GLOBAL  ? "OP_GET_GLOBAL"
+                                               : "OP_SET_GLOBAL",
+               operand);
+        printValue(vm.globalNames.values[operand]);
+        printf("'\n");
+        return offset + 5;
+    case OP_GET_LOCAL:
+        printf("%-16s %4d\n", "OP_GET_LOCAL", operand);
+        return offset + 5;
+    case OP_SET_LOCAL:
+        printf("%-16s %4d\n", "OP_SET_LOCAL", operand);
+        return offset + 5;
+    case OP_GET_UPVALUE:
+        printf("%-16s %4d\n", "OP_GET_UPVALUE", operand);
+        return offset + 5;
+    case OP_SET_UPVALUE:
+        printf("%-16s %4d\n", "OP_SET_UPVALUE", operand);
+        return offset + 5;
+    case OP_GET_CAPTURED:
+        printf("%-16s %4d\n", "OP_GET_CAPTURED", operand);
+        return offset + 5;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_LOOP:
+        printf("%-16s %4d -> %d\n",
+               instruction == OP_JUMP            ? "OP_JUMP"
+               : instruction == OP_JUMP_IF_FALSE ? "OP_JUMP_IF_FALSE"
+               : instruction == OP_POP_JUMP_IF_FALSE
+                   ? "OP_POP_JUMP_IF_FALSE"
+               : instruction == OP_POP_JUMP_IF_TRUE ? "OP_POP_JUMP_IF_TRUE"
+                                                    : "OP_LOOP",
+               offset, jumpTarget(chunk, offset));
+        return offset + 5;
+    case OP_CLOSURE:
+        {
+            printf("%-16s %4d", "OP_CLOSURE", operand);
+            printValue(chunk->constants.values[operand]);
+            printf("\n");
+
+            offset += 5;
+            ObjFunction* function = AS_FUNCTION(
+                chunk->constants.values[operand]);
+            int count = function->upvalueCount + function->capturedCount;
+            for (int j = 0; j < count; j++)
+            {
+                int flags = chunk->code[offset];
+                int index = readWide(chunk, offset + 1);
+                printf("%04d    |                   %s %d%s\n", offset,
+                       flags & CAPTURE_LOCAL ? "local" : "upvalue", index,
+                       flags & CAPTURE_BY_VALUE ? " (by value)" : "");
+                offset += 4;
+            }
+            return offset;
+        }
+    default:
+        printf("Unknown opcode %d\n", instruction);
+        return offset + 2;
+    }
+}
+
 void disassembleChunk(Chunk* chunk, const char* name)
 {
     printf("== %s ==\n", name);
@@ -89,11 +198,11 @@ int disassembleInstruction(Chunk* chunk, int offset)
     case OP_POP:
         return simpleInstruction("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
         return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -106,6 +215,14 @@ int disassembleInstruction(Chunk* chunk, int offset)
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_INLINE_GUARD:
+        return guardInstruction(chunk, offset);
+    case OP_PEEK:
+        return byteInstruction("OP_PEEK", chunk, offset);
+    case OP_INLINE_RETURN:
+        return byteInstruction("OP_INLINE_RETURN", chunk, offset);
     case OP_CLOSURE:
         {
             offset++;
@@ -116,12 +233,14 @@ int disassembleInstruction(Chunk* chunk, int offset)
 
             ObjFunction* function = AS_FUNCTION(
                 chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++)
+            int count = function->upvalueCount + function->capturedCount;
+            for (int j = 0; j < count; j++)
             {
-                int isLocal = chunk->code[offset++];
+                int flags = chunk->code[offset++];
                 int index = chunk->code[offset++];
-                printf("%04d    |                   %s %d\n",
-                       offset - 2, isLocal ? "local" : "upvalue", index);
+                printf("%04d    |                   %s %d%s\n", offset - 2,
+                       flags & CAPTURE_LOCAL ? "local" : "upvalue", index,
+                       flags & CAPTURE_BY_VALUE ? " (by value)" : "");
             }
             return offset;
         }
@@ -129,8 +248,62 @@ int disassembleInstruction(Chunk* chunk, int offset)
         return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
         return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_CAPTURED:
+        return byteInstruction("OP_GET_CAPTURED", chunk, offset);
     case OP_CLOSE_UPVALUE:
-        return simpleInstruction("OP_SET_UPVALUE", offset);
+        return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+    case OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simpleInstruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+        return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+        return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+        return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case OP_GREATER_NUM:
+        return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+        return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_GET_LOCAL_2:
+        return twoByteInstruction("OP_GET_LOCAL_2", chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_SET_GLOBAL_POP:
+        return globalInstruction("OP_SET_GLOBAL_POP", chunk, offset);
+    case OP_ADD_CONSTANT:
+        return constantInstruction("OP_ADD_CONSTANT", chunk, offset);
+    case OP_SUBTRACT_CONSTANT:
+        return constantInstruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+    case OP_MULTIPLY_CONSTANT:
+        return constantInstruction("OP_MULTIPLY_CONSTANT", chunk, offset);
+    case OP_DIVIDE_CONSTANT:
+        return constantInstruction("OP_DIVIDE_CONSTANT", chunk, offset);
+    case OP_NOT_EQUAL:
+        return simpleInstruction("OP_NOT_EQUAL", offset);
+    case OP_GREATER_EQUAL:
+        return simpleInstruction("OP_GREATER_EQUAL", offset);
+    case OP_LESS_EQUAL:
+        return simpleInstruction("OP_LESS_EQUAL", offset);
+    case OP_JUMP_IF_NOT_LESS:
+        return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+        return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_LESS:
+        return jumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_GREATER:
+        return jumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_POP_JUMP_IF_TRUE:
+        return jumpInstruction("OP_POP_JUMP_IF_TRUE", 1, chunk, offset);
+    case OP_WIDE:
+        return wideInstruction(chunk, offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
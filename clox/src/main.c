@@ -1,8 +1,10 @@
 #include "chuck.h"
 #include "common.h"
+#include "optimizer.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static void repl()
 {
@@ -17,7 +19,7 @@ static void repl()
             break;
         }
 
-        interpret(line);
+        interpret(line, PASS_PEEPHOLE, false);
     }
 }
 
@@ -53,34 +55,158 @@ static char* readFile(const char* path)
     return buffer;
 }
 
-static void runFile(const char* path)
+static bool gcStats = false;
+
+static int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void printGcStats()
+{
+    fprintf(stderr, "gc: %d minor, %d major collections\n",
+            vm.minorCollections, vm.majorCollections);
+    if (vm.gcPauseCount == 0)
+        return;
+
+    double* pauses = vm.gcPauses;
+    int count = vm.gcPauseCount;
+    qsort(pauses, count, sizeof(double), compareDoubles);
+
+    double total = 0;
+    for (int i = 0; i < count; i++)
+        total += pauses[i];
+
+    fprintf(stderr, "gc: %d pauses, %.0f us total, p50 %.0f us, "
+            "p99 %.0f us, max %.0f us\n",
+            count, total * 1e6, pauses[count / 2] * 1e6,
+            pauses[count * 99 / 100] * 1e6, pauses[count - 1] * 1e6);
+}
+
+static void runFile(const char* path, int passes, bool lazy)
 {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = interpret(source, passes, lazy);
     free(source);
 
+    if (gcStats)
+        printGcStats();
+
     if (result == INTERPRET_COMPILE_ERROR)
         exit(65);
     if (result == INTERPRET_RUNTIME_ERROR)
         exit(70);
 }
 
+// Parses a comma-separated list of pass names, as in "fold,jumps". Returns
+// -1 on a name it doesn't know.
+static int parsePasses(const char* list)
+{
+    static const struct
+    {
+        const char* name;
+        int pass;
+    } names[] = {
+        {"fold", PASS_FOLD},
+        {"copy", PASS_COPY_PROPAGATION},
+        {"dce", PASS_DEAD_CODE},
+        {"jumps", PASS_JUMP_THREADING},
+        {"peephole", PASS_PEEPHOLE},
+        {"inline", PASS_INLINE},
+    };
+
+    int passes = PASSES_NONE;
+    while (*list != '\0')
+    {
+        size_t length = strcspn(list, ",");
+        int pass = -1;
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        {
+            if (strlen(names[i].name) == length &&
+                memcmp(names[i].name, list, length) == 0)
+            {
+                pass = names[i].pass;
+            }
+        }
+        if (pass == -1)
+            return -1;
+
+        passes |= pass;
+        list += length;
+        if (*list == ',')
+            list++;
+    }
+    return passes;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [-O0 | --passes=fold,copy,dce,jumps,peephole,inline] [--lazy] [--gc-stats] [--gc-budget=N] [--gc-threads=N] [path]\n");
+    exit(64);
+}
+
 int main(int argc, char* argv[])
 {
     initVM();
 
-    if (argc == 1)
+    int passes = PASSES_ALL;
+    bool lazy = false;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        if (strcmp(argv[arg], "-O0") == 0)
+        {
+            passes = PASSES_NONE;
+        }
+        else if (strncmp(argv[arg], "--passes=", 9) == 0)
+        {
+            passes = parsePasses(argv[arg] + 9);
+            if (passes == -1)
+                usage();
+        }
+        else if (strcmp(argv[arg], "--lazy") == 0)
+        {
+            lazy = true;
+        }
+        else if (strcmp(argv[arg], "--gc-stats") == 0)
+        {
+            gcStats = true;
+        }
+#ifdef INCREMENTAL_GC
+        else if (strncmp(argv[arg], "--gc-budget=", 12) == 0)
+        {
+            vm.gcStepBudget = atoi(argv[arg] + 12);
+            if (vm.gcStepBudget < 1)
+                usage();
+        }
+#endif
+#ifdef PARALLEL_GC
+        else if (strncmp(argv[arg], "--gc-threads=", 13) == 0)
+        {
+            vm.gcThreads = atoi(argv[arg] + 13);
+            if (vm.gcThreads < 1)
+                usage();
+        }
+#endif
+        else
+        {
+            usage();
+        }
+    }
+
+    if (arg == argc)
     {
         repl();
     }
-    else if (argc == 2)
+    else if (arg == argc - 1)
     {
-        runFile(argv[1]);
+        runFile(argv[arg], passes, lazy);
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path\n]");
-        exit(64);
+        usage();
     }
 
     freeVM();
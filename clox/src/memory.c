@@ -1,4 +1,13 @@
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef PARALLEL_GC
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 #include "compiler.h"
 #include "memory.h"
@@ -10,9 +19,16 @@
 
 #endif
 
+#ifdef PAGED_HEAP
+// The cell itself is reused once its page is swept.
+#define FREE_OBJECT(type, object) (vm.bytesAllocated -= sizeof(type))
+#else
+#define FREE_OBJECT(type, object) FREE(type, object)
+#endif
+
 static void freeObject(Obj* object)
 {
-#ifdef debug_log_gc
+#ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
@@ -22,52 +38,384 @@ static void freeObject(Obj* object)
         {
             ObjString* string = (ObjString*)object;
             FREE_ARRAY(char, string->chars, string->len + 1);
-            FREE(ObjString, object);
+            FREE_OBJECT(ObjString, object);
             break;
         }
     case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            FREE_OBJECT(ObjFunction, object);
             break;
         }
     case OBJ_NATIVE:
         {
-            FREE(ObjNative, object);
+            FREE_OBJECT(ObjNative, object);
             break;
         }
     case OBJ_CLOSURE:
         {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_ARRAY(Value, closure->captured, closure->capturedCount);
+            FREE_OBJECT(ObjClosure, object);
             break;
         }
     case OBJ_UPVALUE:
         {
-            FREE(ObjUpvalue, object);
+            FREE_OBJECT(ObjUpvalue, object);
             break;
         }
     }
 }
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+#ifdef POOL_ALLOCATOR
+#define POOL_CLASS(size) (((size) - 1) / POOL_GRANULE)
+#define POOL_CLASSES (POOL_CLASS(POOL_MAX_SIZE) + 1)
+
+typedef struct PoolBlock
+{
+    struct PoolBlock* next;
+} PoolBlock;
+
+// Free blocks of each size class. Blocks are carved out of pages that are
+// only handed back to libc when the VM shuts down.
+static PoolBlock* freeBlocks[POOL_CLASSES];
+static void** pages = NULL;
+static int pageCount = 0;
+static int pageCapacity = 0;
+
+static PoolBlock* newPage(int sizeClass)
+{
+    char* page = malloc(POOL_PAGE_SIZE);
+    if (page == NULL) exit(1);
+
+    if (pageCapacity < pageCount + 1)
+    {
+        pageCapacity = GROW_CAPACITY(pageCapacity);
+        pages = realloc(pages, sizeof(void*) * pageCapacity);
+
+        if (pages == NULL) exit(1);
+    }
+    pages[pageCount++] = page;
+
+    size_t size = (size_t)(sizeClass + 1) * POOL_GRANULE;
+    PoolBlock* blocks = NULL;
+    for (size_t offset = POOL_PAGE_SIZE / size * size; offset > 0;)
+    {
+        offset -= size;
+        PoolBlock* block = (PoolBlock*)(page + offset);
+        block->next = blocks;
+        blocks = block;
+    }
+    return blocks;
+}
+
+static void* poolAllocate(size_t size)
+{
+    int sizeClass = POOL_CLASS(size);
+    PoolBlock* block = freeBlocks[sizeClass];
+    if (block == NULL)
+        block = newPage(sizeClass);
+
+    freeBlocks[sizeClass] = block->next;
+    return block;
+}
+
+static void poolFree(void* pointer, size_t size)
+{
+    int sizeClass = POOL_CLASS(size);
+    PoolBlock* block = pointer;
+    block->next = freeBlocks[sizeClass];
+    freeBlocks[sizeClass] = block;
+}
+
+// Like realloc(), but blocks of up to POOL_MAX_SIZE bytes come from the
+// pools. Every caller passes the size it allocated, so the size class of
+// the old block doesn't have to be stored anywhere.
+static void* poolReallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+    bool oldPooled = oldSize != 0 && oldSize <= POOL_MAX_SIZE;
+    bool newPooled = newSize != 0 && newSize <= POOL_MAX_SIZE;
+
+    if (!oldPooled && !newPooled)
+    {
+        if (newSize == 0)
+        {
+            free(pointer);
+            return NULL;
+        }
+
+        void* result = realloc(pointer, newSize);
+        if (result == NULL)
+            exit(1);
+        return result;
+    }
+
+    if (oldPooled && newPooled && POOL_CLASS(oldSize) == POOL_CLASS(newSize))
+        return pointer;
+
+    void* result = NULL;
+    if (newPooled)
+    {
+        result = poolAllocate(newSize);
+    }
+    else if (newSize != 0)
+    {
+        result = malloc(newSize);
+        if (result == NULL)
+            exit(1);
+    }
+
+    if (result != NULL && pointer != NULL)
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+
+    if (oldPooled)
+        poolFree(pointer, oldSize);
+    else
+        free(pointer);
+    return result;
+}
+
+void freePools()
+{
+    for (int i = 0; i < pageCount; i++)
+    {
+        free(pages[i]);
+    }
+    free(pages);
+
+    pages = NULL;
+    pageCount = 0;
+    pageCapacity = 0;
+    memset(freeBlocks, 0, sizeof(freeBlocks));
+}
+#endif
+
+// Counts the bytes and collects if they take the heap over its threshold.
+static void countAllocation(size_t oldSize, size_t newSize)
 {
     vm.bytesAllocated += newSize - oldSize;
 
     if (newSize > oldSize)
     {
+#ifdef GENERATIONAL_GC
+        vm.youngBytes += newSize - oldSize;
+#endif
+#ifdef INCREMENTAL_GC
+        vm.stepBytes += newSize - oldSize;
+#endif
+
 #ifdef DEBUG_STRESS_GC
+#if defined(GENERATIONAL_GC)
+        // A missing write barrier only shows up in a minor collection.
+        collectYoung();
+#elif defined(INCREMENTAL_GC)
+        gcStep();
+#else
         collectGarbage();
 #endif
+#endif
 
+#ifdef INCREMENTAL_GC
+        if (vm.gcPhase == GC_IDLE ? vm.bytesAllocated > vm.nextGC
+                                  : vm.stepBytes > GC_STEP_BYTES)
+        {
+            gcStep();
+        }
+#else
         if (vm.bytesAllocated > vm.nextGC)
         {
             collectGarbage();
         }
+#ifdef GENERATIONAL_GC
+        else if (vm.youngBytes > GC_NURSERY_SIZE)
+        {
+            collectYoung();
+        }
+#endif
+#endif
     }
+}
+
+#ifdef PAGED_HEAP
+#define HEAP_CLASSES (HEAP_MAX_CELL / HEAP_GRANULE)
+// Cells start on the first granule after the page header.
+#define FIRST_GRANULE ((sizeof(HeapPage) + HEAP_GRANULE - 1) / HEAP_GRANULE)
+
+typedef struct FreeCell
+{
+    struct FreeCell* next;
+} FreeCell;
+
+typedef struct
+{
+    HeapPage* pages;
+    // The pages from here to the end of `pages` haven't been swept since
+    // the last collection. Their free cells aren't in `freeCells` yet.
+    HeapPage* unswept;
+    FreeCell* freeCells;
+} SizeClass;
+
+static SizeClass sizeClasses[HEAP_CLASSES];
+// Whether some page hasn't been swept since the last collection.
+static bool sweepPending = false;
+// Bytes allocated when that collection finished marking, and how many of
+// them sweeping has freed since.
+static size_t markedBytes;
+static size_t sweptBytes;
+
+// Frees the page's unmarked objects and puts every empty cell on the free
+// list. Only the bitmaps and the dead cells are touched.
+static void sweepPage(SizeClass* sizeClass, HeapPage* page)
+{
+    size_t before = vm.bytesAllocated;
+    size_t cellGranules = page->cellSize / HEAP_GRANULE;
 
+    for (size_t granule = FIRST_GRANULE;
+         granule + cellGranules <= HEAP_PAGE_GRANULES;
+         granule += cellGranules)
+    {
+        size_t word = granule / 64;
+        uint64_t bit = (uint64_t)1 << (granule % 64);
+        if (page->marks[word] & bit)
+            continue;
+
+        char* cell = (char*)page + granule * HEAP_GRANULE;
+        if (page->allocated[word] & bit)
+        {
+            freeObject((Obj*)cell);
+            page->allocated[word] &= ~bit;
+        }
+
+        FreeCell* freeCell = (FreeCell*)cell;
+        freeCell->next = sizeClass->freeCells;
+        sizeClass->freeCells = freeCell;
+    }
+
+    memset(page->marks, 0, sizeof(page->marks));
+    sweptBytes += before - vm.bytesAllocated;
+}
+
+// Sweeps every page left over from the last collection, which clears all
+// the mark bits and tells how much of the heap that collection kept.
+static void finishSweep()
+{
+    if (!sweepPending)
+        return;
+
+    for (int i = 0; i < HEAP_CLASSES; i++)
+    {
+        SizeClass* sizeClass = &sizeClasses[i];
+        while (sizeClass->unswept != NULL)
+        {
+            HeapPage* page = sizeClass->unswept;
+            sizeClass->unswept = page->next;
+            sweepPage(sizeClass, page);
+        }
+    }
+
+    sweepPending = false;
+    vm.nextGC = (markedBytes - sweptBytes) * GC_HEAP_GROW_FACTOR;
+}
+
+// Called once marking is done. Pages are swept as their size class runs
+// out of free cells.
+static void startSweep()
+{
+    for (int i = 0; i < HEAP_CLASSES; i++)
+    {
+        sizeClasses[i].unswept = sizeClasses[i].pages;
+        sizeClasses[i].freeCells = NULL;
+    }
+
+    sweepPending = true;
+    markedBytes = vm.bytesAllocated;
+    sweptBytes = 0;
+}
+
+static void newHeapPage(SizeClass* sizeClass)
+{
+    HeapPage* page = aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+    if (page == NULL) exit(1);
+
+    page->cellSize = (size_t)(sizeClass - sizeClasses + 1) * HEAP_GRANULE;
+    memset(page->marks, 0, sizeof(page->marks));
+    memset(page->allocated, 0, sizeof(page->allocated));
+    page->next = sizeClass->pages;
+    sizeClass->pages = page;
+
+    sweepPage(sizeClass, page);
+}
+
+void* allocateCell(size_t size)
+{
+    countAllocation(0, size);
+
+    SizeClass* sizeClass = &sizeClasses[(size - 1) / HEAP_GRANULE];
+    while (sizeClass->freeCells == NULL)
+    {
+        if (sizeClass->unswept != NULL)
+        {
+            HeapPage* page = sizeClass->unswept;
+            sizeClass->unswept = page->next;
+            sweepPage(sizeClass, page);
+        }
+        else if (sweepPending)
+        {
+            // Reclaim the rest of the garbage before growing the heap.
+            finishSweep();
+        }
+        else
+        {
+            newHeapPage(sizeClass);
+        }
+    }
+
+    FreeCell* cell = sizeClass->freeCells;
+    sizeClass->freeCells = cell->next;
+
+    size_t granule = GRANULE_OF(cell);
+    PAGE_OF(cell)->allocated[granule / 64] |= (uint64_t)1 << (granule % 64);
+    return cell;
+}
+
+static void freePages()
+{
+    for (int i = 0; i < HEAP_CLASSES; i++)
+    {
+        HeapPage* page = sizeClasses[i].pages;
+        while (page != NULL)
+        {
+            HeapPage* next = page->next;
+            size_t cellGranules = page->cellSize / HEAP_GRANULE;
+            for (size_t granule = FIRST_GRANULE;
+                 granule + cellGranules <= HEAP_PAGE_GRANULES;
+                 granule += cellGranules)
+            {
+                if (page->allocated[granule / 64] &
+                    (uint64_t)1 << (granule % 64))
+                {
+                    freeObject((Obj*)((char*)page + granule * HEAP_GRANULE));
+                }
+            }
+            free(page);
+            page = next;
+        }
+    }
+
+    memset(sizeClasses, 0, sizeof(sizeClasses));
+    sweepPending = false;
+}
+#endif
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+    countAllocation(oldSize, newSize);
+
+#ifdef POOL_ALLOCATOR
+    return poolReallocate(pointer, oldSize, newSize);
+#else
     if (newSize == 0)
     {
         free(pointer);
@@ -78,19 +426,90 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
     if (result == NULL)
         exit(1);
     return result;
+#endif
 }
 
+#ifdef PARALLEL_GC
+typedef struct
+{
+    // Gray objects only this worker touches.
+    Obj** stack;
+    int count;
+    int capacity;
+
+    // Gray objects it has offered to the others, guarded by `lock`.
+    pthread_mutex_t lock;
+    Obj** shared;
+    int sharedCount;
+    int sharedCapacity;
+
+    pthread_t thread;
+} MarkWorker;
+
+static MarkWorker workers[GC_MAX_THREADS];
+// Workers whose locks have been initialized.
+static int workersCreated = 0;
+// Workers taking part in the current trace.
+static int workerCount;
+static int idleWorkers;
+// While set, every thread marking is a worker and pushes onto its own stack.
+static bool markingInParallel = false;
+static _Thread_local MarkWorker* currentWorker = NULL;
+
+static void pushGray(Obj*** stack, int* count, int* capacity, Obj* object)
+{
+    if (*capacity < *count + 1)
+    {
+        *capacity = GROW_CAPACITY(*capacity);
+        *stack = realloc(*stack, sizeof(Obj*) * *capacity);
+
+        if (*stack == NULL) exit(1);
+    }
+    (*stack)[(*count)++] = object;
+}
+
+// Other workers may be marking the same object, so setting the bit has to
+// be atomic. Only the worker that sets it traces the object.
+static void markFromWorker(Obj* object)
+{
+#ifdef PAGED_HEAP
+    uint64_t* word = &PAGE_OF(object)->marks[GRANULE_OF(object) / 64];
+    uint64_t bit = (uint64_t)1 << (GRANULE_OF(object) % 64);
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return;
+    if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) return;
+#else
+    if (__atomic_load_n(&object->isMarked, __ATOMIC_RELAXED)) return;
+    if (__atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED)) return;
+#endif
+
+    MarkWorker* worker = currentWorker;
+    pushGray(&worker->stack, &worker->count, &worker->capacity, object);
+}
+#endif
+
 void markObject(Obj* object)
 {
     if (object == NULL) return;
-    if (object->isMarked) return;
+#ifdef PARALLEL_GC
+    if (markingInParallel)
+    {
+        markFromWorker(object);
+        return;
+    }
+#endif
+    if (isMarked(object)) return;
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
 
+#ifdef PAGED_HEAP
+    PAGE_OF(object)->marks[GRANULE_OF(object) / 64] |=
+        (uint64_t)1 << (GRANULE_OF(object) % 64);
+#else
     object->isMarked = true;
+#endif
 
     if (vm.grayCapacity < vm.grayCount + 1)
     {
@@ -129,19 +548,19 @@ static void markRoots()
         markObject((Obj*)vm.frames[i].closure);
     }
 
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
-         upvalue = upvalue->next)
+    for (int i = 0; i < vm.openCount; i++)
     {
-        markObject((Obj*)upvalue);
+        markObject((Obj*)vm.openOrder[i]);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
     markCompilerRoots();
 }
 
 static void blackenObject(Obj* object)
 {
-#ifndef DEBUG_LOG_GC
+#ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
     printf("\n");
@@ -156,12 +575,18 @@ static void blackenObject(Obj* object)
             {
                 markObject((Obj*)closure->upvalues[i]);
             }
+            for (int i = 0; i < closure->capturedCount; i++)
+            {
+                markValue(closure->captured[i]);
+            }
             break;
         }
     case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
+            markObject((Obj*)function->closure);
+            markObject((Obj*)function->source);
             markArray(&function->chunk.constants);
             break;
         }
@@ -174,8 +599,156 @@ static void blackenObject(Obj* object)
     }
 }
 
+#ifdef PARALLEL_GC
+// Moves `count` objects from the top of one stack to another.
+static void moveGray(Obj** from, int* fromCount, Obj*** to, int* toCount,
+                     int* toCapacity, int count)
+{
+    for (int i = *fromCount - count; i < *fromCount; i++)
+    {
+        pushGray(to, toCount, toCapacity, from[i]);
+    }
+    *fromCount -= count;
+}
+
+// Offers half of the worker's own gray objects to the others.
+static void shareWork(MarkWorker* worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    int count = worker->count / 2;
+    int shared = worker->sharedCount;
+    moveGray(worker->stack, &worker->count, &worker->shared, &shared,
+             &worker->sharedCapacity, count);
+    __atomic_store_n(&worker->sharedCount, shared, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Takes half of `victim`'s shared objects, or all of them if it is the
+// worker itself.
+static bool takeWork(MarkWorker* worker, MarkWorker* victim)
+{
+    if (__atomic_load_n(&victim->sharedCount, __ATOMIC_RELAXED) == 0)
+        return false;
+
+    pthread_mutex_lock(&victim->lock);
+    int shared = victim->sharedCount;
+    int count = victim == worker ? shared : (shared + 1) / 2;
+    moveGray(victim->shared, &shared, &worker->stack, &worker->count,
+             &worker->capacity, count);
+    __atomic_store_n(&victim->sharedCount, shared, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&victim->lock);
+    return count > 0;
+}
+
+static bool stealWork(MarkWorker* worker)
+{
+    int self = (int)(worker - workers);
+    for (int i = 0; i < workerCount; i++)
+    {
+        if (takeWork(worker, &workers[(self + i) % workerCount]))
+            return true;
+    }
+    return false;
+}
+
+// Once a worker is idle its shared stack is empty and nothing adds to it,
+// so when every worker is idle there is nothing left to mark.
+static bool findWork(MarkWorker* worker)
+{
+    if (stealWork(worker))
+        return true;
+
+    __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&idleWorkers, __ATOMIC_SEQ_CST) < workerCount)
+    {
+        __atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+        if (stealWork(worker))
+            return true;
+        __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+        sched_yield();
+    }
+    return false;
+}
+
+static void* runWorker(void* argument)
+{
+    MarkWorker* worker = argument;
+    currentWorker = worker;
+
+    do
+    {
+        while (worker->count > 0)
+        {
+            Obj* object = worker->stack[--worker->count];
+            blackenObject(object);
+
+            if (worker->count > GC_SHARE_THRESHOLD &&
+                __atomic_load_n(&worker->sharedCount, __ATOMIC_RELAXED) == 0)
+            {
+                shareWork(worker);
+            }
+        }
+    }
+    while (findWork(worker));
+
+    currentWorker = NULL;
+    return NULL;
+}
+
+static int gcThreadCount()
+{
+    int count = vm.gcThreads;
+    if (count == 0)
+        count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > GC_MAX_THREADS)
+        count = GC_MAX_THREADS;
+    return count < 1 ? 1 : count;
+}
+
+// Deals the gray objects out to the workers and has them trace the rest of
+// the heap. The calling thread is the first worker.
+static void traceParallel(int count)
+{
+    for (; workersCreated < count; workersCreated++)
+    {
+        pthread_mutex_init(&workers[workersCreated].lock, NULL);
+    }
+
+    for (int i = 0; i < vm.grayCount; i++)
+    {
+        MarkWorker* worker = &workers[i % count];
+        pushGray(&worker->stack, &worker->count, &worker->capacity,
+                 vm.grayStack[i]);
+    }
+    vm.grayCount = 0;
+
+    workerCount = count;
+    idleWorkers = 0;
+    markingInParallel = true;
+    for (int i = 1; i < count; i++)
+    {
+        pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+    }
+    runWorker(&workers[0]);
+    for (int i = 1; i < count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    markingInParallel = false;
+}
+#endif
+
 static void traceReferences()
 {
+#ifdef PARALLEL_GC
+    int threads = gcThreadCount();
+    if (threads > 1 && vm.bytesAllocated >= GC_PARALLEL_MIN_BYTES)
+    {
+        traceParallel(threads);
+        return;
+    }
+#endif
+
     while (vm.grayCount > 0)
     {
         Obj* object = vm.grayStack[--vm.grayCount];
@@ -183,6 +756,28 @@ static void traceReferences()
     }
 }
 
+static double now()
+{
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void recordPause(double start)
+{
+    if (vm.gcPauseCapacity < vm.gcPauseCount + 1)
+    {
+        vm.gcPauseCapacity = GROW_CAPACITY(vm.gcPauseCapacity);
+        vm.gcPauses = realloc(vm.gcPauses,
+                              sizeof(double) * vm.gcPauseCapacity);
+
+        if (vm.gcPauses == NULL) exit(1);
+    }
+
+    vm.gcPauses[vm.gcPauseCount++] = now() - start;
+}
+
+#if !defined(PAGED_HEAP) && !defined(INCREMENTAL_GC)
 static void sweep()
 {
     Obj* previous = NULL;
@@ -192,7 +787,9 @@ static void sweep()
     {
         if (object->isMarked)
         {
+#ifndef GENERATIONAL_GC
             object->isMarked = false;
+#endif
             previous = object;
             object = object->next;
         } else
@@ -212,20 +809,217 @@ static void sweep()
         }
     }
 }
+#endif
+
+#ifdef GENERATIONAL_GC
+void rememberObject(Obj* object)
+{
+    if (vm.rememberedCapacity < vm.rememberedCount + 1)
+    {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = realloc(vm.remembered,
+                                sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    object->isRemembered = true;
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+static void forgetRemembered()
+{
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+}
+
+// Frees the unmarked young objects and promotes the rest by moving them to
+// the old list, still marked.
+static void sweepYoung()
+{
+    Obj* object = vm.youngObjects;
+    while (object != NULL)
+    {
+        Obj* next = object->next;
+        if (object->isMarked)
+        {
+            object->next = vm.objects;
+            vm.objects = object;
+        }
+        else
+        {
+            freeObject(object);
+        }
+        object = next;
+    }
+
+    vm.youngObjects = NULL;
+    vm.youngBytes = 0;
+}
+
+// A minor collection: traces only young objects, from the roots and the
+// remembered old objects, and promotes every survivor. Old objects are
+// already marked, so marking stops at them.
+void collectYoung()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+    double start = now();
+
+    vm.minorCollections++;
+    markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        blackenObject(vm.remembered[i]);
+    }
+    forgetRemembered();
+    traceReferences();
+    tableRemoveWhite(&vm.strings);
+    sweepYoung();
+    recordPause(start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("    collected %ld bytes (from %ld to %ld)\n",
+        before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+#endif
+
+#ifdef INCREMENTAL_GC
+void shadeObject(Obj* object)
+{
+    if (vm.gcPhase == GC_MARK)
+        markObject(object);
+}
+
+// Does at most `budget` objects' worth of marking or sweeping. Starting a
+// cycle and finishing its marking are not divided up.
+static void incrementalStep(int budget)
+{
+    switch (vm.gcPhase)
+    {
+    case GC_IDLE:
+#ifdef DEBUG_LOG_GC
+        printf("-- gc begin\n");
+#endif
+        markRoots();
+        vm.gcPhase = GC_MARK;
+        break;
+
+    case GC_MARK:
+        while (vm.grayCount > 0 && budget-- > 0)
+        {
+            Obj* object = vm.grayStack[--vm.grayCount];
+            blackenObject(object);
+        }
+        if (vm.grayCount > 0)
+            break;
+
+        // Stores into the stack and globals aren't behind the write barrier,
+        // so whatever the roots point at now still has to be traced.
+        markRoots();
+        traceReferences();
+        tableRemoveWhite(&vm.strings);
+
+        // Objects allocated from here on are white, and go on a fresh list
+        // the sweep never sees.
+        vm.sweeping = vm.objects;
+        vm.objects = NULL;
+        vm.gcPhase = GC_SWEEP;
+        break;
+
+    case GC_SWEEP:
+        while (vm.sweeping != NULL && budget-- > 0)
+        {
+            Obj* object = vm.sweeping;
+            vm.sweeping = object->next;
+            if (object->isMarked)
+            {
+                object->isMarked = false;
+                object->next = vm.objects;
+                vm.objects = object;
+            }
+            else
+            {
+                freeObject(object);
+            }
+        }
+        if (vm.sweeping != NULL)
+            break;
+
+        vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+        vm.majorCollections++;
+        vm.gcPhase = GC_IDLE;
+#ifdef DEBUG_LOG_GC
+        printf("-- gc end\n");
+        printf("    %ld bytes in use, next at %ld\n",
+               vm.bytesAllocated, vm.nextGC);
+#endif
+        break;
+    }
+}
 
+void gcStep()
+{
+    double start = now();
+    incrementalStep(vm.gcStepBudget);
+    vm.stepBytes = 0;
+    recordPause(start);
+}
+
+void collectGarbage()
+{
+    double start = now();
+    do
+    {
+        incrementalStep(INT_MAX);
+    }
+    while (vm.gcPhase != GC_IDLE);
+    recordPause(start);
+}
+#else
 void collectGarbage()
 {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
     size_t before = vm.bytesAllocated;
 #endif
+    double start = now();
+
+    vm.majorCollections++;
+#ifdef GENERATIONAL_GC
+    // Old objects stay marked between collections, so a full one starts by
+    // clearing them. Everything still alive afterwards is old.
+    for (Obj* object = vm.objects; object != NULL; object = object->next)
+    {
+        object->isMarked = false;
+    }
+    forgetRemembered();
+#endif
+#ifdef PAGED_HEAP
+    finishSweep();
+#endif
 
     markRoots();
     traceReferences();
     tableRemoveWhite(&vm.strings);
+#ifdef PAGED_HEAP
+    startSweep();
+#else
     sweep();
+#endif
+#ifdef GENERATIONAL_GC
+    sweepYoung();
+#endif
 
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    recordPause(start);
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -234,16 +1028,44 @@ void collectGarbage()
         vm.nextGC);
 #endif
 }
+#endif
 
-void freeObjects()
+#ifndef PAGED_HEAP
+static void freeList(Obj* object)
 {
-    Obj* object = vm.objects;
     while (object != NULL)
     {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+}
+#endif
+
+void freeObjects()
+{
+#ifdef PAGED_HEAP
+    freePages();
+#else
+    freeList(vm.objects);
+#endif
+#ifdef GENERATIONAL_GC
+    freeList(vm.youngObjects);
+    free(vm.remembered);
+#endif
+#ifdef INCREMENTAL_GC
+    freeList(vm.sweeping);
+#endif
+
+#ifdef PARALLEL_GC
+    for (int i = 0; i < workersCreated; i++)
+    {
+        free(workers[i].stack);
+        free(workers[i].shared);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+#endif
 
     free(vm.grayStack);
+    free(vm.gcPauses);
 }
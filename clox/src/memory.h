@@ -20,10 +20,112 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+// A minor collection runs once this many bytes have been allocated since
+// the last collection of any kind.
+#define GC_NURSERY_SIZE (256 * 1024)
+
+// While an incremental collection is running, the collector takes a step
+// each time this many bytes have been allocated. A step marks or sweeps up
+// to GC_STEP_BUDGET objects unless --gc-budget says otherwise.
+#define GC_STEP_BYTES (16 * 1024)
+#define GC_STEP_BUDGET 1000
+
+// With POOL_ALLOCATOR, blocks of up to POOL_MAX_SIZE bytes are rounded up
+// to a multiple of POOL_GRANULE and taken from per-size free lists, which
+// are refilled a POOL_PAGE_SIZE page at a time.
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_PAGE_SIZE (64 * 1024)
+
+// Tracing is split across threads only once the heap is this big. A worker
+// offers half its gray objects to the others once it has more than
+// GC_SHARE_THRESHOLD of them and none on offer.
+#define GC_PARALLEL_MIN_BYTES (4 * 1024 * 1024)
+#define GC_SHARE_THRESHOLD 64
+#define GC_MAX_THREADS 16
+
+#if defined(GENERATIONAL_GC) && defined(INCREMENTAL_GC)
+#error "GENERATIONAL_GC and INCREMENTAL_GC can't be combined."
+#endif
+
+#ifdef PAGED_HEAP
+#if defined(GENERATIONAL_GC) || defined(INCREMENTAL_GC)
+#error "PAGED_HEAP can't be combined with GENERATIONAL_GC or INCREMENTAL_GC."
+#endif
+
+// With PAGED_HEAP, objects live in HEAP_PAGE_SIZE pages aligned to their
+// size, so an object's page is found by masking its address. A page holds
+// cells of one size, a multiple of HEAP_GRANULE up to HEAP_MAX_CELL, and
+// keeps one mark bit and one allocated bit per granule in its header.
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define HEAP_GRANULE 16
+#define HEAP_MAX_CELL 256
+#define HEAP_PAGE_GRANULES (HEAP_PAGE_SIZE / HEAP_GRANULE)
+
+typedef struct HeapPage
+{
+    struct HeapPage* next;
+    size_t cellSize;
+    uint64_t marks[HEAP_PAGE_GRANULES / 64];
+    uint64_t allocated[HEAP_PAGE_GRANULES / 64];
+} HeapPage;
+
+#define PAGE_OF(object)                                                        \
+  ((HeapPage *)((uintptr_t)(object) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+#define GRANULE_OF(object)                                                     \
+  (((uintptr_t)(object) & (HEAP_PAGE_SIZE - 1)) / HEAP_GRANULE)
+
+void* allocateCell(size_t size);
+
+static inline bool isMarked(Obj* object) {
+  uint64_t word = PAGE_OF(object)->marks[GRANULE_OF(object) / 64];
+  return (word >> (GRANULE_OF(object) % 64)) & 1;
+}
+#else
+static inline bool isMarked(Obj* object) {
+  return object->isMarked;
+}
+#endif
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
 void freeObjects();
+#ifdef POOL_ALLOCATOR
+void freePools();
+#endif
+
+#ifdef GENERATIONAL_GC
+void collectYoung();
+void rememberObject(Obj* object);
+
+// Call after storing `value` into a field of `object`. Between collections
+// only old objects are marked, so this catches an old object that now
+// points at a young one. Minor collections trace those as roots.
+static inline void writeBarrier(Obj* object, Value value) {
+  if (object->isMarked && !object->isRemembered && IS_OBJ(value) &&
+      !AS_OBJ(value)->isMarked) {
+    rememberObject(object);
+  }
+}
+#elif defined(INCREMENTAL_GC)
+void gcStep();
+void shadeObject(Obj* object);
+
+// Call after storing `value` into a field of `object`. While a collection is
+// marking, a marked object may already have been traced, so anything white
+// stored into it is marked here instead of being missed.
+static inline void writeBarrier(Obj* object, Value value) {
+  if (object->isMarked && IS_OBJ(value) && !AS_OBJ(value)->isMarked) {
+    shadeObject(AS_OBJ(value));
+  }
+}
+#else
+static inline void writeBarrier(Obj* object, Value value) {
+  (void)object;
+  (void)value;
+}
+#endif
 
 #endif // !clox_memory_h
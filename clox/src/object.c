@@ -14,11 +14,22 @@
 
 static Obj* allocateObject(size_t size, ObjType type)
 {
+#ifdef PAGED_HEAP
+    Obj* object = (Obj*)allocateCell(size);
+    object->type = type;
+#else
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
     object->isMarked = false;
+#ifdef GENERATIONAL_GC
+    object->isRemembered = false;
+    object->next = vm.youngObjects;
+    vm.youngObjects = object;
+#else
     object->next = vm.objects;
     vm.objects = object;
+#endif
+#endif
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %ld for %d\n", (void*)object, size, type);
@@ -34,7 +45,11 @@ static ObjString* allocateString(char* chars, int len, uint32_t hash)
     string->chars = chars;
     string->hash = hash;
 
+    // Growing the intern table can collect, and nothing refers to the new
+    // string yet.
+    push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
+    pop();
 
     return string;
 }
@@ -71,23 +86,37 @@ ObjUpvalue* newUpvalue(Value* slot)
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
-    upvalue->next = NULL;
     return upvalue;
 }
 
 ObjClosure* newClosure(ObjFunction* function)
 {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,
-                                     function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++)
+    ObjUpvalue** upvalues = NULL;
+    if (function->upvalueCount > 0)
+    {
+        upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+        for (int i = 0; i < function->upvalueCount; i++)
+        {
+            upvalues[i] = NULL;
+        }
+    }
+
+    Value* captured = NULL;
+    if (function->capturedCount > 0)
     {
-        upvalues[i] = NULL;
+        captured = ALLOCATE(Value, function->capturedCount);
+        for (int i = 0; i < function->capturedCount; i++)
+        {
+            captured[i] = NIL_VAL;
+        }
     }
 
     ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalueCount = function->upvalueCount;
     closure->upvalues = upvalues;
+    closure->capturedCount = function->capturedCount;
+    closure->captured = captured;
     return closure;
 }
 
@@ -97,7 +126,12 @@ ObjFunction* newFunction()
 
     function->arity = 0;
     function->upvalueCount = 0;
+    function->capturedCount = 0;
+    function->maxStack = 0;
     function->name = NULL;
+    function->closure = NULL;
+    function->source = NULL;
+    function->sourceLine = 0;
     initChunk(&function->chunk);
     return function;
 }
@@ -25,8 +25,17 @@ typedef enum { OBJ_STRING, OBJ_FUNCTION, OBJ_NATIVE, OBJ_CLOSURE, OBJ_UPVALUE }
 struct Obj
 {
     ObjType type;
+#ifndef PAGED_HEAP
     bool isMarked;
+#endif
+#ifdef GENERATIONAL_GC
+    // In the remembered set: an old object that may point at young ones.
+    bool isRemembered;
+#endif
+#ifndef PAGED_HEAP
+    // With PAGED_HEAP, the pages keep the mark bits and the list of objects.
     struct Obj* next;
+#endif
 };
 
 typedef struct
@@ -34,8 +43,22 @@ typedef struct
     Obj obj;
     int arity;
     int upvalueCount;
+    // Captured variables that are never assigned, which closures hold as
+    // plain values instead of through an ObjUpvalue.
+    int capturedCount;
     Chunk chunk;
+    // Most stack slots the chunk ever uses, counting slot zero and the
+    // arguments. Computed by the compiler.
+    int maxStack;
     ObjString* name;
+    // A function that captures nothing gets one closure, made by the
+    // compiler, which every OP_CLOSURE for it pushes. NULL otherwise.
+    struct ObjClosure* closure;
+    // Under lazy compilation, the parameter list and body of a function
+    // that hasn't been called yet, starting on sourceLine. The chunk is
+    // compiled from it on the first call. NULL once compiled.
+    ObjString* source;
+    int sourceLine;
 } ObjFunction;
 
 typedef struct ObjUpvalue
@@ -43,18 +66,21 @@ typedef struct ObjUpvalue
     Obj obj;
     Value* location;
     Value closed;
-    struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct
+typedef struct ObjClosure
 {
     Obj obj;
     ObjFunction* function;
     ObjUpvalue** upvalues;
     int upvalueCount;
+    Value* captured;
+    int capturedCount;
 } ObjClosure;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// Stores the call's value in `result`. Returns false after reporting a
+// runtime error.
+typedef bool (*NativeFn)(int argCount, Value* args, Value* result);
 
 typedef struct
 {
@@ -0,0 +1,1277 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chuck.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+// One decoded instruction. Superinstructions and fused branches are split
+// back into their parts when a chunk is lifted, so the passes only deal
+// with the basic opcodes, and are fused again when it is lowered. OP_JUMP
+// stands for OP_LOOP as well; lowering picks the direction.
+typedef struct
+{
+    uint8_t op;
+    // Constant index, slot, global slot or argument count. For jumps, the
+    // index of the instruction jumped to.
+    int operand;
+    int line;
+    // Offset in the original chunk, to copy OP_CLOSURE's upvalue pairs.
+    int source;
+    // Stack depth before the instruction, or -1 when it is unreachable.
+    int depth;
+    // Removed instructions stay in place as dead entries so that jump
+    // targets keep their indices. A jump to one goes to the next live one.
+    bool live;
+    // Starts a basic block: the entry, a jump target, or after a branch.
+    bool leader;
+} Instruction;
+
+typedef struct
+{
+    ObjFunction* function;
+    Instruction* code;
+    int count;
+    int capacity;
+} Ir;
+
+// Evaluates a binary operator over constant operands the way the VM would.
+// Returns false when the VM would reject the operands, so the error still
+// happens at runtime.
+bool evaluateBinary(uint8_t instruction, Value a, Value b, Value* result)
+{
+    switch (instruction)
+    {
+    case OP_EQUAL:
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    case OP_NOT_EQUAL:
+        *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    default:
+        break;
+    }
+
+    if (instruction == OP_ADD && IS_STRING(a) && IS_STRING(b))
+    {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int len = left->len + right->len;
+        char* chars = ALLOCATE(char, len + 1);
+        memcpy(chars, left->chars, left->len);
+        memcpy(chars + left->len, right->chars, right->len);
+        chars[len] = '\0';
+        *result = OBJ_VAL(takeString(chars, len));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    // The same C operations the VM runs, so folding can't change a result.
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (instruction)
+    {
+    case OP_ADD: *result = NUMBER_VAL(x + y); return true;
+    case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+    case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+    case OP_DIVIDE: *result = NUMBER_VAL(x / y); return true;
+    case OP_GREATER: *result = BOOL_VAL(x > y); return true;
+    case OP_LESS: *result = BOOL_VAL(x < y); return true;
+    case OP_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+    case OP_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+    default: return false;
+    }
+}
+
+bool evaluateUnary(uint8_t instruction, Value value, Value* result)
+{
+    switch (instruction)
+    {
+    case OP_NOT:
+        *result = BOOL_VAL(IS_NIL(value) ||
+            (IS_BOOL(value) && !AS_BOOL(value)));
+        return true;
+    case OP_NEGATE:
+        if (!IS_NUMBER(value)) return false;
+        *result = NUMBER_VAL(-AS_NUMBER(value));
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void append(Ir* ir, uint8_t op, int operand, int line, int source)
+{
+    if (ir->capacity < ir->count + 1)
+    {
+        int oldCapacity = ir->capacity;
+        ir->capacity = GROW_CAPACITY(oldCapacity);
+        ir->code = GROW_ARRAY(Instruction, ir->code, oldCapacity,
+                              ir->capacity);
+    }
+
+    Instruction* instruction = &ir->code[ir->count++];
+    instruction->op = op;
+    instruction->operand = operand;
+    instruction->line = line;
+    instruction->source = source;
+    instruction->depth = -1;
+    instruction->live = true;
+    instruction->leader = false;
+}
+
+static bool isJump(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE ||
+        op == OP_POP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_TRUE ||
+        op == OP_INLINE_GUARD;
+}
+
+static bool isConstant(uint8_t op)
+{
+    return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE ||
+        op == OP_FALSE;
+}
+
+// Decodes the function's chunk. Returns false on an instruction the
+// optimizer doesn't know, leaving the function unoptimized.
+static bool lift(Ir* ir)
+{
+    Chunk* chunk = &ir->function->chunk;
+    int* indexAt = ALLOCATE(int, chunk->count);
+    int* lines = ALLOCATE(int, chunk->count);
+
+    int offset = 0;
+    for (int i = 0; i < chunk->linesCount; i += 2)
+    {
+        for (int j = 0; j < chunk->lines[i + 1]; j++)
+        {
+            lines[offset++] = chunk->lines[i];
+        }
+    }
+
+    bool known = true;
+    for (offset = 0; offset < chunk->count && known;)
+    {
+        uint8_t* code = &chunk->code[offset];
+        int line = lines[offset];
+        int next = offset + instructionLength(chunk, offset);
+        int operand = next - offset > 1 ? code[1] : 0;
+        int wide = next - offset == 3 ? (code[1] << 8) | code[2] : 0;
+        indexAt[offset] = ir->count;
+
+        switch (code[0])
+        {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_RETURN:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_CLOSE_UPVALUE:
+            append(ir, code[0], 0, line, offset);
+            break;
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLOSURE:
+        case OP_PEEK:
+        case OP_INLINE_RETURN:
+            append(ir, code[0], operand, line, offset);
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            append(ir, code[0], wide, line, offset);
+            break;
+        case OP_GET_LOCAL_2:
+            append(ir, OP_GET_LOCAL, code[1], line, offset);
+            append(ir, OP_GET_LOCAL, code[2], line, offset);
+            break;
+        case OP_SET_LOCAL_POP:
+            append(ir, OP_SET_LOCAL, operand, line, offset);
+            append(ir, OP_POP, 0, line, offset);
+            break;
+        case OP_SET_GLOBAL_POP:
+            append(ir, OP_SET_GLOBAL, wide, line, offset);
+            append(ir, OP_POP, 0, line, offset);
+            break;
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_MULTIPLY_CONSTANT:
+        case OP_DIVIDE_CONSTANT:
+            append(ir, OP_CONSTANT, operand, line, offset);
+            append(ir, code[0] == OP_ADD_CONSTANT ? OP_ADD
+                       : code[0] == OP_SUBTRACT_CONSTANT ? OP_SUBTRACT
+                       : code[0] == OP_MULTIPLY_CONSTANT ? OP_MULTIPLY
+                       : OP_DIVIDE, 0, line, offset);
+            break;
+        case OP_NOT_EQUAL:
+            append(ir, OP_EQUAL, 0, line, offset);
+            append(ir, OP_NOT, 0, line, offset);
+            break;
+        case OP_GREATER_EQUAL:
+            append(ir, OP_LESS, 0, line, offset);
+            append(ir, OP_NOT, 0, line, offset);
+            break;
+        case OP_LESS_EQUAL:
+            append(ir, OP_GREATER, 0, line, offset);
+            append(ir, OP_NOT, 0, line, offset);
+            break;
+        // Jump operands hold the target offset until every instruction has
+        // an index.
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+            append(ir, code[0], next + wide, line, offset);
+            break;
+        case OP_LOOP:
+            append(ir, OP_JUMP, next - wide, line, offset);
+            break;
+        // lower() copies the function constant from the source.
+        case OP_INLINE_GUARD:
+            append(ir, code[0], next + ((code[1] << 8) | code[2]), line,
+                   offset);
+            break;
+        case OP_WIDE:
+            switch (code[1])
+            {
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+            case OP_GET_CAPTURED:
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+                append(ir, code[1], readWide(chunk, offset + 2), line, offset);
+                break;
+            default:
+                // Wide jumps and closures are left as they are.
+                known = false;
+                break;
+            }
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_LESS:
+            append(ir, OP_LESS, 0, line, offset);
+            append(ir, code[0] == OP_JUMP_IF_LESS ? OP_POP_JUMP_IF_TRUE
+                       : OP_POP_JUMP_IF_FALSE, next + wide, line, offset);
+            break;
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_GREATER:
+            append(ir, OP_GREATER, 0, line, offset);
+            append(ir, code[0] == OP_JUMP_IF_GREATER ? OP_POP_JUMP_IF_TRUE
+                       : OP_POP_JUMP_IF_FALSE, next + wide, line, offset);
+            break;
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            append(ir, OP_EQUAL, 0, line, offset);
+            append(ir, code[0] == OP_JUMP_IF_EQUAL ? OP_POP_JUMP_IF_TRUE
+                       : OP_POP_JUMP_IF_FALSE, next + wide, line, offset);
+            break;
+        default:
+            known = false;
+            break;
+        }
+
+        offset = next;
+    }
+
+    for (int i = 0; i < ir->count && known; i++)
+    {
+        Instruction* instruction = &ir->code[i];
+        if (!isJump(instruction->op)) continue;
+        if (instruction->operand >= chunk->count)
+        {
+            known = false;
+            break;
+        }
+        instruction->operand = indexAt[instruction->operand];
+    }
+
+    FREE_ARRAY(int, indexAt, chunk->count);
+    FREE_ARRAY(int, lines, chunk->count);
+    return known;
+}
+
+// The first live instruction at or after `index`.
+static int resolve(Ir* ir, int index)
+{
+    while (index < ir->count && !ir->code[index].live) index++;
+    return index;
+}
+
+static int successors(Ir* ir, int index, int* result)
+{
+    Instruction* instruction = &ir->code[index];
+    int count = 0;
+    switch (instruction->op)
+    {
+    case OP_RETURN:
+        break;
+    case OP_JUMP:
+        result[count++] = resolve(ir, instruction->operand);
+        break;
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_INLINE_GUARD:
+        result[count++] = resolve(ir, instruction->operand);
+        result[count++] = resolve(ir, index + 1);
+        break;
+    default:
+        result[count++] = resolve(ir, index + 1);
+        break;
+    }
+
+    // Falling off the end can't happen in compiled code, but a dead jump
+    // target past the last live instruction is dropped rather than followed.
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (result[i] < ir->count) result[kept++] = result[i];
+    }
+    return kept;
+}
+
+// Recomputes block leaders and the stack depth before each reachable
+// instruction.
+static void analyze(Ir* ir)
+{
+    for (int i = 0; i < ir->count; i++)
+    {
+        ir->code[i].leader = false;
+        ir->code[i].depth = -1;
+    }
+
+    int entry = resolve(ir, 0);
+    if (entry == ir->count) return;
+    ir->code[entry].leader = true;
+
+    for (int i = entry; i < ir->count; i = resolve(ir, i + 1))
+    {
+        Instruction* instruction = &ir->code[i];
+        if (!isJump(instruction->op) && instruction->op != OP_RETURN) continue;
+
+        int next = resolve(ir, i + 1);
+        if (next < ir->count) ir->code[next].leader = true;
+        if (isJump(instruction->op))
+        {
+            int target = resolve(ir, instruction->operand);
+            if (target < ir->count) ir->code[target].leader = true;
+        }
+    }
+
+    int* pending = ALLOCATE(int, ir->count);
+    int pendingCount = 0;
+    ir->code[entry].depth = ir->function->arity + 1;
+    pending[pendingCount++] = entry;
+
+    while (pendingCount > 0)
+    {
+        int index = pending[--pendingCount];
+        Instruction* instruction = &ir->code[index];
+        uint8_t bytes[2] = {instruction->op, (uint8_t)instruction->operand};
+        int depth = instruction->depth + stackEffect(bytes);
+
+        int next[2];
+        int nextCount = successors(ir, index, next);
+        for (int i = 0; i < nextCount; i++)
+        {
+            if (ir->code[next[i]].depth != -1) continue;
+            ir->code[next[i]].depth = depth;
+            pending[pendingCount++] = next[i];
+        }
+    }
+
+    FREE_ARRAY(int, pending, ir->count);
+}
+
+static bool constantValue(Ir* ir, Instruction* instruction, Value* value)
+{
+    switch (instruction->op)
+    {
+    case OP_CONSTANT:
+        *value = ir->function->chunk.constants.values[instruction->operand];
+        return true;
+    case OP_NIL:
+        *value = NIL_VAL;
+        return true;
+    case OP_TRUE:
+        *value = BOOL_VAL(true);
+        return true;
+    case OP_FALSE:
+        *value = BOOL_VAL(false);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Turns `instruction` into one that pushes `value`. Fails when the value
+// needs a constant and the pool is full.
+static bool setConstant(Ir* ir, Instruction* instruction, Value value)
+{
+    if (IS_NIL(value))
+    {
+        instruction->op = OP_NIL;
+    }
+    else if (IS_BOOL(value))
+    {
+        instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+    }
+    else
+    {
+        // Folding happens rarely enough that a scan beats keeping the
+        // compiler's constant set alive this long.
+        Chunk* chunk = &ir->function->chunk;
+        int constant = 0;
+        while (constant < chunk->constants.count &&
+               !valuesIdentical(chunk->constants.values[constant], value))
+        {
+            constant++;
+        }
+        if (constant > UINT24_MAX) return false;
+        if (constant == chunk->constants.count)
+        {
+            addConstant(chunk, value);
+            writeBarrier((Obj*)ir->function, value);
+        }
+        instruction->op = OP_CONSTANT;
+        instruction->operand = constant;
+    }
+    return true;
+}
+
+static void kill(Instruction* instruction)
+{
+    instruction->live = false;
+}
+
+// Folds operators over constants, `!` feeding a branch, branches on
+// constants, and values pushed only to be popped. Works over a window of
+// the last few live instructions in the current block.
+static bool foldConstants(Ir* ir)
+{
+    bool changed = false;
+    int window[2];
+    int windowCount = 0;
+
+    for (int i = resolve(ir, 0); i < ir->count; i = resolve(ir, i + 1))
+    {
+        Instruction* instruction = &ir->code[i];
+        if (instruction->leader) windowCount = 0;
+
+        Instruction* last = windowCount > 0 ? &ir->code[window[windowCount - 1]]
+                                            : NULL;
+        Instruction* previous = windowCount > 1 ? &ir->code[window[0]] : NULL;
+        Value a, b, result;
+
+        switch (instruction->op)
+        {
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+            if (previous != NULL && constantValue(ir, previous, &a) &&
+                constantValue(ir, last, &b) &&
+                evaluateBinary(instruction->op, a, b, &result) &&
+                setConstant(ir, previous, result))
+            {
+                kill(last);
+                kill(instruction);
+                windowCount--;
+                changed = true;
+                continue;
+            }
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+            if (last != NULL && constantValue(ir, last, &a) &&
+                evaluateUnary(instruction->op, a, &result) &&
+                setConstant(ir, last, result))
+            {
+                kill(instruction);
+                changed = true;
+                continue;
+            }
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+            if (last != NULL && !last->leader && last->op == OP_NOT)
+            {
+                instruction->op = instruction->op == OP_POP_JUMP_IF_FALSE
+                                      ? OP_POP_JUMP_IF_TRUE
+                                      : OP_POP_JUMP_IF_FALSE;
+                kill(last);
+                windowCount--;
+                changed = true;
+                continue;
+            }
+            if (last != NULL && !last->leader && constantValue(ir, last, &a))
+            {
+                evaluateUnary(OP_NOT, a, &result);
+                bool taken = AS_BOOL(result) ==
+                    (instruction->op == OP_POP_JUMP_IF_FALSE);
+                kill(last);
+                if (taken)
+                {
+                    instruction->op = OP_JUMP;
+                }
+                else
+                {
+                    kill(instruction);
+                }
+                windowCount--;
+                changed = true;
+                continue;
+            }
+            break;
+        case OP_JUMP_IF_FALSE:
+            if (last != NULL && constantValue(ir, last, &a))
+            {
+                evaluateUnary(OP_NOT, a, &result);
+                if (AS_BOOL(result))
+                {
+                    instruction->op = OP_JUMP;
+                }
+                else
+                {
+                    kill(instruction);
+                }
+                changed = true;
+                continue;
+            }
+            break;
+        case OP_POP:
+            if (last != NULL && !last->leader && (isConstant(last->op) ||
+                last->op == OP_GET_LOCAL || last->op == OP_GET_UPVALUE ||
+                last->op == OP_GET_CAPTURED))
+            {
+                kill(last);
+                kill(instruction);
+                windowCount--;
+                changed = true;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (windowCount == 2)
+        {
+            window[0] = window[1];
+            windowCount = 1;
+        }
+        window[windowCount++] = i;
+    }
+
+    return changed;
+}
+
+// Within a block, remembers what each local slot was last set to when that
+// was a constant or another local, and reads that instead. Also forwards a
+// stored value straight to a read of the same variable right after it. A
+// call can change any captured local, so it forgets everything.
+static bool propagateCopies(Ir* ir)
+{
+    bool changed = false;
+    int slotCount = 0;
+    for (int i = 0; i < ir->count; i++)
+    {
+        Instruction* instruction = &ir->code[i];
+        if (instruction->op == OP_SET_LOCAL && instruction->operand >= slotCount)
+        {
+            slotCount = instruction->operand + 1;
+        }
+    }
+
+    int* knownOp = ALLOCATE(int, slotCount);
+    int* knownOperand = ALLOCATE(int, slotCount);
+    int knownCount = 0;
+    int window[2];
+    int windowCount = 0;
+
+    for (int i = resolve(ir, 0); i < ir->count; i = resolve(ir, i + 1))
+    {
+        Instruction* instruction = &ir->code[i];
+        if (instruction->leader || instruction->depth == -1)
+        {
+            knownCount = 0;
+            windowCount = 0;
+        }
+
+        Instruction* last = windowCount > 0 ? &ir->code[window[windowCount - 1]]
+                                            : NULL;
+        Instruction* previous = windowCount > 1 ? &ir->code[window[0]] : NULL;
+        int slot = instruction->operand;
+
+        switch (instruction->op)
+        {
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+            {
+                // A known constant goes first since it can fold further.
+                bool known = instruction->op == OP_GET_LOCAL &&
+                    slot < knownCount && knownOp[slot] != -1;
+                if (known && isConstant((uint8_t)knownOp[slot]))
+                {
+                    instruction->op = (uint8_t)knownOp[slot];
+                    instruction->operand = knownOperand[slot];
+                    changed = true;
+                    break;
+                }
+
+                uint8_t set = instruction->op == OP_GET_LOCAL ? OP_SET_LOCAL
+                                                              : OP_SET_GLOBAL;
+                if (previous != NULL && previous->op == set &&
+                    previous->operand == slot && last->op == OP_POP)
+                {
+                    kill(last);
+                    kill(instruction);
+                    windowCount--;
+                    changed = true;
+                    continue;
+                }
+
+                if (known)
+                {
+                    instruction->op = (uint8_t)knownOp[slot];
+                    instruction->operand = knownOperand[slot];
+                    changed = true;
+                }
+                break;
+            }
+        case OP_SET_LOCAL:
+            for (int j = 0; j < knownCount; j++)
+            {
+                if (knownOp[j] == OP_GET_LOCAL && knownOperand[j] == slot)
+                {
+                    knownOp[j] = -1;
+                }
+            }
+            while (knownCount <= slot) knownOp[knownCount++] = -1;
+
+            knownOp[slot] = -1;
+            if (last != NULL && (isConstant(last->op) ||
+                (last->op == OP_GET_LOCAL && last->operand != slot)))
+            {
+                knownOp[slot] = last->op;
+                knownOperand[slot] = last->operand;
+            }
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            knownCount = 0;
+            break;
+        default:
+            break;
+        }
+
+        // Slots popped off the stack are reused by the next local declared
+        // there, which doesn't go through OP_SET_LOCAL.
+        uint8_t bytes[2] = {instruction->op, (uint8_t)instruction->operand};
+        int depth = instruction->depth + stackEffect(bytes);
+        if (knownCount > depth) knownCount = depth < 0 ? 0 : depth;
+        for (int j = 0; j < knownCount; j++)
+        {
+            if (knownOp[j] == OP_GET_LOCAL && knownOperand[j] >= depth)
+            {
+                knownOp[j] = -1;
+            }
+        }
+
+        if (windowCount == 2)
+        {
+            window[0] = window[1];
+            windowCount = 1;
+        }
+        window[windowCount++] = i;
+    }
+
+    FREE_ARRAY(int, knownOp, slotCount);
+    FREE_ARRAY(int, knownOperand, slotCount);
+    return changed;
+}
+
+static bool eliminateDeadCode(Ir* ir)
+{
+    bool changed = false;
+    for (int i = 0; i < ir->count; i++)
+    {
+        if (ir->code[i].live && ir->code[i].depth == -1)
+        {
+            kill(&ir->code[i]);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Points jumps that land on an unconditional jump straight at its target,
+// turns a jump to a return into the return, and drops jumps to the next
+// instruction.
+static bool threadJumps(Ir* ir)
+{
+    bool changed = false;
+    for (int i = resolve(ir, 0); i < ir->count; i = resolve(ir, i + 1))
+    {
+        Instruction* instruction = &ir->code[i];
+        if (!isJump(instruction->op)) continue;
+
+        bool conditional = instruction->op != OP_JUMP;
+        int target = resolve(ir, instruction->operand);
+        for (int hops = 0; hops < ir->count && target < ir->count; hops++)
+        {
+            Instruction* landing = &ir->code[target];
+            bool chains = landing->op == OP_JUMP ||
+                (instruction->op == OP_JUMP_IF_FALSE &&
+                    landing->op == OP_JUMP_IF_FALSE);
+            if (!chains || target == i) break;
+
+            // Conditional jumps only go forward.
+            int next = resolve(ir, landing->operand);
+            if (conditional && next <= i) break;
+            target = next;
+        }
+
+        if (target != resolve(ir, instruction->operand))
+        {
+            instruction->operand = target;
+            changed = true;
+        }
+
+        if (target >= ir->count) continue;
+        if (instruction->op == OP_JUMP && ir->code[target].op == OP_RETURN)
+        {
+            instruction->op = OP_RETURN;
+            changed = true;
+        }
+        else if (target == resolve(ir, i + 1))
+        {
+            if (instruction->op == OP_POP_JUMP_IF_FALSE ||
+                instruction->op == OP_POP_JUMP_IF_TRUE)
+            {
+                instruction->op = OP_POP;
+            }
+            else
+            {
+                kill(instruction);
+            }
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Whether `operand` is too big for the short form of `op`. Only the
+// instructions lift() accepts in wide form can be.
+static bool needsWide(uint8_t op, int operand)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURED:
+        return operand > UINT8_MAX;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+        return operand > UINT16_MAX;
+    default:
+        return false;
+    }
+}
+
+typedef struct
+{
+    int offset; // Where the jump's operand is in the new code.
+    int end; // Where the jump is measured from.
+    int target; // Instruction index it jumps to.
+} PendingJump;
+
+static void emit(Chunk* chunk, uint8_t byte, int line)
+{
+    writeChunk(chunk, byte, line);
+}
+
+// Encodes the live instructions into `out`, fusing superinstructions and
+// branches the same way the compiler does. Fails if a jump no longer fits
+// its 16-bit operand.
+static bool lower(Ir* ir, Chunk* out)
+{
+    Chunk* chunk = &ir->function->chunk;
+    int* offsetOf = ALLOCATE(int, ir->count + 1);
+    PendingJump* jumps = ALLOCATE(PendingJump, ir->count);
+    int jumpCount = 0;
+    bool fits = true;
+
+    int last = -1;
+    for (int i = 0; i < ir->count; i++)
+    {
+        Instruction* instruction = &ir->code[i];
+        offsetOf[i] = out->count;
+        if (!instruction->live) continue;
+
+        uint8_t op = instruction->op;
+        int line = instruction->line;
+        if (instruction->leader) last = -1;
+
+        if (needsWide(op, instruction->operand))
+        {
+            last = out->count;
+            emit(out, OP_WIDE, line);
+            emit(out, op, line);
+            emit(out, (instruction->operand >> 16) & 0xff, line);
+            emit(out, (instruction->operand >> 8) & 0xff, line);
+            emit(out, instruction->operand & 0xff, line);
+            continue;
+        }
+
+        int fused = last == -1 ? -1
+                        : superinstruction(&out->code[last], op,
+                                           &chunk->constants);
+        if (fused != -1)
+        {
+            out->code[last] = (uint8_t)fused;
+            offsetOf[i] = last;
+            if (op == OP_GET_LOCAL) emit(out, (uint8_t)instruction->operand, line);
+            continue;
+        }
+
+        int branch = last == -1 ||
+                (op != OP_POP_JUMP_IF_FALSE && op != OP_POP_JUMP_IF_TRUE)
+            ? -1
+            : branchInstruction(out->code[last], op == OP_POP_JUMP_IF_TRUE);
+        if (branch != -1)
+        {
+            out->code[last] = (uint8_t)branch;
+            offsetOf[i] = last;
+        }
+        else
+        {
+            last = out->count;
+            if (op == OP_JUMP && resolve(ir, instruction->operand) <= i)
+            {
+                op = OP_LOOP;
+            }
+            emit(out, op, line);
+        }
+
+        switch (op)
+        {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_CAPTURED:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_PEEK:
+        case OP_INLINE_RETURN:
+            emit(out, (uint8_t)instruction->operand, line);
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            emit(out, (instruction->operand >> 8) & 0xff, line);
+            emit(out, instruction->operand & 0xff, line);
+            break;
+        case OP_CLOSURE:
+            {
+                int length = instructionLength(chunk, instruction->source);
+                for (int j = 1; j < length; j++)
+                {
+                    emit(out, chunk->code[instruction->source + j], line);
+                }
+                break;
+            }
+        case OP_LOOP:
+            {
+                int target = resolve(ir, instruction->operand);
+                int jump = out->count + 2 - offsetOf[target];
+                if (jump > UINT16_MAX) fits = false;
+                emit(out, (jump >> 8) & 0xff, line);
+                emit(out, jump & 0xff, line);
+                break;
+            }
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_INLINE_GUARD:
+            if (resolve(ir, instruction->operand) <= i) fits = false;
+            jumps[jumpCount].offset = out->count;
+            jumps[jumpCount].end = out->count + 2;
+            jumps[jumpCount].target = resolve(ir, instruction->operand);
+            jumpCount++;
+            emit(out, 0xff, line);
+            emit(out, 0xff, line);
+            if (op == OP_INLINE_GUARD)
+            {
+                jumps[jumpCount - 1].end++;
+                emit(out, chunk->code[instruction->source + 3], line);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    offsetOf[ir->count] = out->count;
+
+    for (int i = 0; i < jumpCount; i++)
+    {
+        int jump = offsetOf[jumps[i].target] - jumps[i].end;
+        if (jump > UINT16_MAX) fits = false;
+        out->code[jumps[i].offset] = (jump >> 8) & 0xff;
+        out->code[jumps[i].offset + 1] = jump & 0xff;
+    }
+
+    FREE_ARRAY(int, offsetOf, ir->count + 1);
+    FREE_ARRAY(PendingJump, jumps, ir->count);
+    return fits;
+}
+
+void optimizeFunction(ObjFunction* function, int passes)
+{
+    Ir ir;
+    ir.function = function;
+    ir.code = NULL;
+    ir.count = 0;
+    ir.capacity = 0;
+
+    if (lift(&ir))
+    {
+        // Each pass can open up work for the others, such as a propagated
+        // constant that then folds, so run them until nothing changes.
+        bool changed = true;
+        for (int round = 0; changed && round < 8; round++)
+        {
+            changed = false;
+            analyze(&ir);
+            if ((passes & PASS_DEAD_CODE) && eliminateDeadCode(&ir))
+            {
+                changed = true;
+                analyze(&ir);
+            }
+            if ((passes & PASS_COPY_PROPAGATION) && propagateCopies(&ir))
+            {
+                changed = true;
+                analyze(&ir);
+            }
+            if ((passes & PASS_FOLD) && foldConstants(&ir))
+            {
+                changed = true;
+                analyze(&ir);
+            }
+            if ((passes & PASS_JUMP_THREADING) && threadJumps(&ir))
+            {
+                changed = true;
+            }
+        }
+
+        analyze(&ir);
+        Chunk out;
+        initChunk(&out);
+        if (lower(&ir, &out))
+        {
+            Chunk* chunk = &function->chunk;
+            FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+            FREE_ARRAY(int, chunk->lines, chunk->linesCapacity);
+            chunk->code = out.code;
+            chunk->count = out.count;
+            chunk->capacity = out.capacity;
+            chunk->lines = out.lines;
+            chunk->linesCount = out.linesCount;
+            chunk->linesCapacity = out.linesCapacity;
+        }
+        else
+        {
+            freeChunk(&out);
+        }
+    }
+
+    FREE_ARRAY(Instruction, ir.code, ir.capacity);
+}
+
+static bool isUnconditional(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_LOOP;
+}
+
+// Writes the jump at `offset` so it lands on `target`, switching between
+// OP_JUMP and OP_LOOP as needed. Conditional jumps only go forward.
+// Returns false when the jump can't be encoded.
+static bool retarget(Chunk* chunk, int offset, int target)
+{
+    uint8_t* code = &chunk->code[offset];
+    int jump = target - (offset + instructionLength(chunk, offset));
+    if (isUnconditional(code[0]))
+    {
+        if (jump < 0 && -jump > UINT16_MAX) return false;
+        if (jump > UINT16_MAX) return false;
+        code[0] = jump < 0 ? OP_LOOP : OP_JUMP;
+        if (jump < 0) jump = -jump;
+    }
+    else if (jump < 0 || jump > UINT16_MAX)
+    {
+        return false;
+    }
+
+    code[1] = (jump >> 8) & 0xff;
+    code[2] = jump & 0xff;
+    return true;
+}
+
+// One round of rewrites over the chunk. Instructions to drop have their
+// bytes cleared in `keep`; the caller rebuilds the chunk from what's left.
+static bool peepholeRound(Chunk* chunk, int* starts, int startCount,
+                          bool* keep)
+{
+    bool* target = ALLOCATE(bool, chunk->count + 1);
+    bool* reachable = ALLOCATE(bool, chunk->count + 1);
+    int* pending = ALLOCATE(int, chunk->count);
+    for (int i = 0; i <= chunk->count; i++)
+    {
+        target[i] = false;
+        reachable[i] = false;
+    }
+
+    for (int i = 0; i < startCount; i++)
+    {
+        int landing = jumpTarget(chunk, starts[i]);
+        if (landing != -1) target[landing] = true;
+    }
+
+    int pendingCount = 0;
+    reachable[0] = true;
+    pending[pendingCount++] = 0;
+    while (pendingCount > 0)
+    {
+        int offset = pending[--pendingCount];
+        uint8_t op = chunk->code[offset];
+        if (op == OP_WIDE) op = chunk->code[offset + 1];
+        int successors[2];
+        int successorCount = 0;
+        if (op != OP_RETURN && !isUnconditional(op))
+        {
+            successors[successorCount++] =
+                offset + instructionLength(chunk, offset);
+        }
+        if (jumpTarget(chunk, offset) != -1)
+        {
+            successors[successorCount++] = jumpTarget(chunk, offset);
+        }
+
+        for (int i = 0; i < successorCount; i++)
+        {
+            int successor = successors[i];
+            if (successor >= chunk->count || reachable[successor]) continue;
+            reachable[successor] = true;
+            pending[pendingCount++] = successor;
+        }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < startCount; i++)
+    {
+        int offset = starts[i];
+        int length = i + 1 < startCount ? starts[i + 1] - offset
+                                        : chunk->count - offset;
+        uint8_t* code = &chunk->code[offset];
+
+        if (!reachable[offset])
+        {
+            for (int j = 0; j < length; j++) keep[offset + j] = false;
+            changed = true;
+            continue;
+        }
+
+        // A value pushed only to be popped.
+        if ((isConstant(code[0]) || code[0] == OP_GET_LOCAL ||
+                code[0] == OP_GET_UPVALUE || code[0] == OP_GET_CAPTURED) &&
+            offset + length < chunk->count &&
+            chunk->code[offset + length] == OP_POP &&
+            !target[offset + length])
+        {
+            for (int j = 0; j <= length; j++) keep[offset + j] = false;
+            changed = true;
+            i++;
+            continue;
+        }
+
+        // Wide jumps are rare enough to leave alone.
+        int landing = jumpTarget(chunk, offset);
+        if (landing == -1 || code[0] == OP_WIDE) continue;
+
+        // Follow jumps that land on unconditional jumps.
+        int final = landing;
+        for (int hops = 0; hops < startCount; hops++)
+        {
+            int next = final < chunk->count &&
+                    isUnconditional(chunk->code[final])
+                ? jumpTarget(chunk, final)
+                : -1;
+            if (next == -1 || next == final || next == offset) break;
+            if (!isUnconditional(code[0]) && next <= offset) break;
+            final = next;
+        }
+        if (final != landing && retarget(chunk, offset, final))
+        {
+            changed = true;
+        }
+        landing = jumpTarget(chunk, offset);
+
+        if (isUnconditional(code[0]) && landing < chunk->count &&
+            chunk->code[landing] == OP_RETURN)
+        {
+            code[0] = OP_RETURN;
+            keep[offset + 1] = false;
+            keep[offset + 2] = false;
+            changed = true;
+        }
+        else if (landing == offset + length)
+        {
+            // A jump to the next instruction. The popping branches still
+            // have to pop their condition.
+            if (code[0] == OP_POP_JUMP_IF_FALSE ||
+                code[0] == OP_POP_JUMP_IF_TRUE)
+            {
+                code[0] = OP_POP;
+                keep[offset + 1] = false;
+                keep[offset + 2] = false;
+                changed = true;
+            }
+            else if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE)
+            {
+                for (int j = 0; j < length; j++) keep[offset + j] = false;
+                changed = true;
+            }
+        }
+    }
+
+    FREE_ARRAY(bool, target, chunk->count + 1);
+    FREE_ARRAY(bool, reachable, chunk->count + 1);
+    FREE_ARRAY(int, pending, chunk->count);
+    return changed;
+}
+
+// Copies the bytes still in `keep` into a new chunk, moving every jump to
+// where its target ended up.
+static void compact(Chunk* chunk, int* starts, int startCount, bool* keep)
+{
+    int* lines = ALLOCATE(int, chunk->count);
+    int offset = 0;
+    for (int i = 0; i < chunk->linesCount; i += 2)
+    {
+        for (int j = 0; j < chunk->lines[i + 1]; j++)
+        {
+            lines[offset++] = chunk->lines[i];
+        }
+    }
+
+    // Where each old offset lands: the next byte kept at or after it.
+    int* moved = ALLOCATE(int, chunk->count + 1);
+    int count = 0;
+    for (int i = 0; i < chunk->count; i++)
+    {
+        moved[i] = count;
+        if (keep[i]) count++;
+    }
+    moved[chunk->count] = count;
+
+    Chunk out;
+    initChunk(&out);
+    for (int i = 0; i < startCount; i++)
+    {
+        int start = starts[i];
+        int end = i + 1 < startCount ? starts[i + 1] : chunk->count;
+        int landing = keep[start] ? jumpTarget(chunk, start) : -1;
+        for (int j = start; j < end; j++)
+        {
+            if (keep[j]) writeChunk(&out, chunk->code[j], lines[j]);
+        }
+
+        if (landing != -1 && out.code[moved[start]] == OP_WIDE)
+        {
+            int at = moved[start];
+            int jump = out.code[at + 1] == OP_LOOP ? at + 5 - moved[landing]
+                                                   : moved[landing] - (at + 5);
+            out.code[at + 2] = (jump >> 16) & 0xff;
+            out.code[at + 3] = (jump >> 8) & 0xff;
+            out.code[at + 4] = jump & 0xff;
+        }
+        else if (landing != -1)
+        {
+            // Removing code only brings targets closer, so this fits.
+            int at = moved[start];
+            int end = at + instructionLength(&out, at);
+            int jump = out.code[at] == OP_LOOP ? end - moved[landing]
+                                               : moved[landing] - end;
+            out.code[at + 1] = (jump >> 8) & 0xff;
+            out.code[at + 2] = jump & 0xff;
+        }
+    }
+
+    FREE_ARRAY(int, lines, chunk->count);
+    FREE_ARRAY(int, moved, chunk->count + 1);
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->linesCapacity);
+    chunk->code = out.code;
+    chunk->count = out.count;
+    chunk->capacity = out.capacity;
+    chunk->lines = out.lines;
+    chunk->linesCount = out.linesCount;
+    chunk->linesCapacity = out.linesCapacity;
+}
+
+void peephole(Chunk* chunk)
+{
+    bool changed = true;
+    for (int round = 0; changed && round < 8; round++)
+    {
+        int count = chunk->count;
+        int* starts = ALLOCATE(int, count);
+        bool* keep = ALLOCATE(bool, count);
+        int startCount = 0;
+        for (int offset = 0; offset < count;
+             offset += instructionLength(chunk, offset))
+        {
+            starts[startCount++] = offset;
+        }
+        for (int i = 0; i < count; i++) keep[i] = true;
+
+        changed = peepholeRound(chunk, starts, startCount, keep);
+        if (changed) compact(chunk, starts, startCount, keep);
+
+        FREE_ARRAY(int, starts, count);
+        FREE_ARRAY(bool, keep, count);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "object.h"
+
+// Passes the optimizing compiler runs over each function. Scripts run from
+// a file get all of them; the REPL only gets the peephole pass.
+typedef enum
+{
+    PASS_FOLD = 1 << 0, // Fold constants and constant branches.
+    PASS_COPY_PROPAGATION = 1 << 1, // Replace reads of copied locals.
+    PASS_DEAD_CODE = 1 << 2, // Drop unreachable instructions.
+    PASS_JUMP_THREADING = 1 << 3, // Retarget jumps that land on jumps.
+    PASS_PEEPHOLE = 1 << 4, // Clean up the finished bytecode.
+    PASS_INLINE = 1 << 5, // Inline small global functions where called.
+} OptimizerPass;
+
+#define PASSES_NONE 0
+#define PASSES_ALL (PASS_FOLD | PASS_COPY_PROPAGATION | PASS_DEAD_CODE | \
+                    PASS_JUMP_THREADING | PASS_PEEPHOLE | PASS_INLINE)
+
+void optimizeFunction(ObjFunction* function, int passes);
+void peephole(Chunk* chunk);
+bool evaluateBinary(uint8_t instruction, Value a, Value b, Value* result);
+bool evaluateUnary(uint8_t instruction, Value value, Value* result);
+
+#endif // !clox_optimizer_h
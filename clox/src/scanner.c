@@ -179,10 +179,13 @@ static Token identifier() {
   return makeToken(identifierType());
 }
 
-void initScanner(const char *source) {
+void initScanner(const char *source) { initScannerAt(source, 1); }
+
+// Starts scanning `source` as if it began on `line`.
+void initScannerAt(const char *source, int line) {
   scanner.start = source;
   scanner.current = source;
-  scanner.line = 1;
+  scanner.line = line;
 }
 
 Token scanToken() {
@@ -56,6 +56,7 @@ typedef struct {
 } Token;
 
 void initScanner(const char *source);
+void initScannerAt(const char *source, int line);
 Token scanToken();
 
 #endif // !clox_scanner_h
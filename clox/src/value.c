@@ -28,6 +28,19 @@ void freeValueArray(ValueArray *array) {
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  } else if (IS_UNDEFINED(value)) {
+    printf("undefined");
+  }
+#else
   switch (value.type) {
   case VAL_BOOL:
     printf(AS_BOOL(value) ? "true" : "false");
@@ -41,10 +54,21 @@ void printValue(Value value) {
   case VAL_OBJ:
     printObject(value);
     break;
+  case VAL_UNDEFINED:
+    printf("undefined");
+    break;
   }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // Compare numbers as doubles so that NaN != NaN, as in the tagged build.
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  return a == b;
+#else
   if (a.type != b.type)
     return false;
 
@@ -52,6 +76,7 @@ bool valuesEqual(Value a, Value b) {
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
+  case VAL_UNDEFINED:
     return true;
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
@@ -65,4 +90,65 @@ bool valuesEqual(Value a, Value b) {
   default:
     return false;
   }
+#endif
+}
+
+// Unlike valuesEqual, numbers compare by their bits: 0 and -0 are different
+// values here, and a NaN is identical to itself.
+bool valuesIdentical(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  if (a.type != b.type)
+    return false;
+
+  switch (a.type) {
+  case VAL_BOOL:
+    return AS_BOOL(a) == AS_BOOL(b);
+  case VAL_NIL:
+  case VAL_UNDEFINED:
+    return true;
+  case VAL_NUMBER: {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  case VAL_OBJ:
+    return AS_OBJ(a) == AS_OBJ(b);
+  default:
+    return false;
+  }
+#endif
+}
+
+// A hash consistent with valuesIdentical.
+uint32_t hashValue(Value value) {
+  uint64_t bits;
+#ifdef NAN_BOXING
+  bits = value;
+#else
+  switch (value.type) {
+  case VAL_NUMBER: {
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(double));
+    break;
+  }
+  case VAL_OBJ:
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+    break;
+  case VAL_BOOL:
+    bits = AS_BOOL(value);
+    break;
+  default:
+    bits = 0;
+    break;
+  }
+  bits ^= (uint64_t)value.type << 56;
+#endif
+  // Mix the high bits down: the low bits of small integers and of aligned
+  // pointers are mostly zero.
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
 }
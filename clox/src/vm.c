@@ -16,11 +16,28 @@
 
 VM vm;
 
+static void closeUpvalues(Value* last);
+
 static void resetStack()
 {
+    // Closures that outlive the error keep the values they captured.
+    closeUpvalues(vm.stack);
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+}
+
+// The offset of the OP_INLINE_GUARD whose inlined body holds the
+// instruction at `offset`, or -1 if it isn't in one.
+static int inlinedAt(Chunk* chunk, int offset)
+{
+    for (int i = 0; i < offset; i += instructionLength(chunk, i))
+    {
+        if (chunk->code[i] == OP_INLINE_GUARD && offset < jumpTarget(chunk, i))
+        {
+            return i;
+        }
+    }
+    return -1;
 }
 
 static void runtimeError(const char* format, ...)
@@ -37,6 +54,20 @@ static void runtimeError(const char* format, ...)
         ObjFunction* function = frame->closure->function;
 
         size_t instruction = frame->ip - function->chunk.code - 1;
+
+        // An error in an inlined body is reported as if the function had
+        // been called from the line of the call.
+        int guard = inlinedAt(&function->chunk, (int)instruction);
+        if (guard != -1)
+        {
+            Value inlined =
+                function->chunk.constants.values[function->chunk.code[guard + 3]];
+            fprintf(stderr, "[line %d] in %s()\n",
+                    getLine(&function->chunk, (int)instruction),
+                    AS_FUNCTION(inlined)->name->chars);
+            instruction = guard;
+        }
+
         int line = getLine(&function->chunk, instruction);
         fprintf(stderr, "[line %d] in ", line);
 
@@ -53,54 +84,124 @@ static void runtimeError(const char* format, ...)
     resetStack();
 }
 
-static Value clockNative(int argCount, Value* args)
+static bool clockNative(int argCount, Value* args, Value* result)
 {
+    (void)args;
     if (argCount > 0)
     {
         runtimeError("Expected 0 arguments but got %d.", argCount);
+        return false;
     }
-    return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+    *result = NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+    return true;
 }
 
-static Value lenNative(int argCount, Value* args)
+static bool lenNative(int argCount, Value* args, Value* result)
 {
     if (argCount != 1)
     {
         runtimeError("Expected 1 arguments but got %d.", argCount);
+        return false;
     }
 
     Value arg = args[0];
-    switch (arg.type)
+    if (!IS_STRING(arg))
     {
-    case VAL_OBJ:
-        {
-            Obj* object = AS_OBJ(arg);
-            if (object->type == OBJ_STRING)
-            {
-                ObjString* string = AS_STRING(arg);
-                return NUMBER_VAL((double) string->len);
-            }
-        }
-    default:
-        break;
+        runtimeError("'len' can accept only string argument");
+        return false;
     }
-    runtimeError("'len' can accept only string argument");
+    *result = NUMBER_VAL((double) AS_STRING(arg)->len);
+    return true;
 }
 
 
+int globalSlot(ObjString* name)
+{
+    Value index;
+    if (tableGet(&vm.globalSlots, name, &index)) return (int)AS_NUMBER(index);
+
+    // Growing the arrays or the table can collect, so keep the name rooted.
+    push(OBJ_VAL(name));
+    int slot = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL((double)slot));
+    pop();
+    return slot;
+}
+
 static void defineNative(const char* name, NativeFn function)
 {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
 
+// Grows the stack until `needed` more values fit above its top. The values
+// are copied into a new array so the old one is still there to rebase the
+// frame and open upvalue pointers against.
+static void growStack(int needed)
+{
+    int count = (int)(vm.stackTop - vm.stack);
+    int oldCapacity = vm.stackCapacity;
+    int capacity = oldCapacity;
+    while (capacity < count + needed) capacity = GROW_CAPACITY(capacity);
+
+    Value* stack = ALLOCATE(Value, capacity);
+    if (count > 0) memcpy(stack, vm.stack, count * sizeof(Value));
+
+    ObjUpvalue** openUpvalues = ALLOCATE(ObjUpvalue*, capacity);
+    for (int i = 0; i < capacity; i++)
+    {
+        openUpvalues[i] = i < oldCapacity ? vm.openUpvalues[i] : NULL;
+    }
+
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (int i = 0; i < vm.openCount; i++)
+    {
+        ObjUpvalue* upvalue = vm.openOrder[i];
+        if (upvalue->location == &upvalue->closed) continue;
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+
+    FREE_ARRAY(Value, vm.stack, oldCapacity);
+    FREE_ARRAY(ObjUpvalue*, vm.openUpvalues, oldCapacity);
+    vm.stack = stack;
+    vm.openUpvalues = openUpvalues;
+    vm.stackTop = stack + count;
+    vm.stackCapacity = capacity;
+}
+
+// Compiles a function deferred by lazy compilation. The compiler keeps
+// what it allocates reachable by pushing it, so it gets some stack first.
+static bool compileDeferred(ObjFunction* function)
+{
+    if (vm.stackTop + UINT8_COUNT > vm.stack + vm.stackCapacity)
+    {
+        growStack(UINT8_COUNT);
+    }
+    if (compileFunction(function)) return true;
+
+    runtimeError("Could not compile %s().", function->name->chars);
+    return false;
+}
+
 static bool call(ObjClosure* closure, int argCount)
 {
+    if (closure->function->source != NULL &&
+        !compileDeferred(closure->function))
+    {
+        return false;
+    }
+
     if (argCount != closure->function->arity)
     {
         runtimeError("Expected %d arguments but got %d.",
@@ -108,10 +209,29 @@ static bool call(ObjClosure* closure, int argCount)
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX)
+    // The frame array never grows past FRAMES_MAX, so a full array is the
+    // only place an overflow can happen.
+    if (vm.frameCount == vm.frameCapacity)
     {
-        runtimeError("Stack overflow.");
-        return false;
+        if (vm.frameCount == FRAMES_MAX)
+        {
+            runtimeError("Stack overflow.");
+            return false;
+        }
+
+        int oldCapacity = vm.frameCapacity;
+        vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+        if (vm.frameCapacity > FRAMES_MAX) vm.frameCapacity = FRAMES_MAX;
+        vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity,
+                               vm.frameCapacity);
+    }
+
+    // The compiler worked out how deep the function's stack can get, so this
+    // one check covers every push until it returns.
+    Value* frameEnd = vm.stackTop - argCount - 1 + closure->function->maxStack;
+    if (frameEnd > vm.stack + vm.stackCapacity)
+    {
+        growStack((int)(frameEnd - vm.stackTop));
     }
 
     CallFrame* frame = &vm.frames[vm.frameCount++];
@@ -132,7 +252,9 @@ static bool callValue(Value callee, int argCount)
         case OBJ_NATIVE:
             {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
+                Value result;
+                if (!native(argCount, vm.stackTop - argCount, &result))
+                    return false;
                 vm.stackTop -= argCount + 1;
                 push(result);
                 return true;
@@ -147,45 +269,68 @@ static bool callValue(Value callee, int argCount)
 
 static ObjUpvalue* captureUpvalue(Value* local)
 {
-    ObjUpvalue* previousUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
-    while (upvalue != NULL && upvalue->location > local)
-    {
-        previousUpvalue = upvalue;
-        upvalue = upvalue->next;
-    }
+    int slot = (int)(local - vm.stack);
+    if (vm.openUpvalues[slot] != NULL) return vm.openUpvalues[slot];
 
-    if (upvalue != NULL && upvalue->location == local)
+    // Make room first: the new upvalue isn't reachable until it's listed.
+    if (vm.openCapacity < vm.openCount + 1)
     {
-        return upvalue;
+        int oldCapacity = vm.openCapacity;
+        vm.openCapacity = GROW_CAPACITY(oldCapacity);
+        vm.openOrder = GROW_ARRAY(ObjUpvalue*, vm.openOrder, oldCapacity,
+                                  vm.openCapacity);
     }
 
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    ObjUpvalue* upvalue = newUpvalue(local);
+    vm.openOrder[vm.openCount++] = upvalue;
+    vm.openUpvalues[slot] = upvalue;
+    return upvalue;
+}
 
-    createdUpvalue->next = upvalue;
-    if (previousUpvalue == NULL)
-    {
-        vm.openUpvalues = createdUpvalue;
-    }
-    else
+static void closeUpvalue(ObjUpvalue* upvalue)
+{
+    vm.openUpvalues[upvalue->location - vm.stack] = NULL;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    writeBarrier((Obj*)upvalue, upvalue->closed);
+}
+
+// Drops upvalues that were closed out of order from the end of openOrder.
+static void trimOpenUpvalues()
+{
+    while (vm.openCount > 0)
     {
-        previousUpvalue->next = createdUpvalue;
+        ObjUpvalue* upvalue = vm.openOrder[vm.openCount - 1];
+        if (upvalue->location != &upvalue->closed) break;
+        vm.openCount--;
     }
-
-    return createdUpvalue;
 }
 
+// Closes every upvalue at or above `last`, which must be the base of the
+// current frame: within a frame, upvalues aren't opened in slot order.
 static void closeUpvalues(Value* last)
 {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last)
+    while (vm.openCount > 0)
     {
-        ObjUpvalue* upvalue = vm.openUpvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        ObjUpvalue* upvalue = vm.openOrder[vm.openCount - 1];
+        if (upvalue->location != &upvalue->closed)
+        {
+            if (upvalue->location < last) break;
+            closeUpvalue(upvalue);
+        }
+        vm.openCount--;
     }
 }
 
+// Closes the upvalue for one local going out of scope, if it has one.
+static void closeLocal(Value* local)
+{
+    ObjUpvalue* upvalue = vm.openUpvalues[local - vm.stack];
+    if (upvalue == NULL) return;
+    closeUpvalue(upvalue);
+    trimOpenUpvalues();
+}
+
 static bool isFalsey(Value value)
 {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
@@ -193,8 +338,10 @@ static bool isFalsey(Value value)
 
 static void concatenate()
 {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+    // Keep both operands on the stack while allocating so a collection
+    // triggered by ALLOCATE can still reach them.
+    ObjString* b = AS_STRING(peek(0));
+    ObjString* a = AS_STRING(peek(1));
 
     int len = a->len + b->len;
     char* chars = ALLOCATE(char, len + 1);
@@ -202,272 +349,800 @@ static void concatenate()
     memcpy(chars + a->len, b->chars, b->len);
     chars[len] = '\0';
     ObjString* result = takeString(chars, len);
+    pop();
+    pop();
     push(OBJ_VAL(result));
 }
 
 static InterpretResult run()
 {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    // The hot interpreter state lives in locals so the compiler can keep it
+    // in registers. It is written back to the CallFrame and vm.stackTop only
+    // where something else can observe it: calls, returns, allocations (which
+    // may collect garbage) and runtime errors.
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* sp = vm.stackTop;
+    Value* slots;
+    Value* constants;
+
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->chunk.constants.values;              \
+  } while (false)
+#define SYNC() (frame->ip = ip, vm.stackTop = sp)
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_SHORT() \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                                               \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_WIDE() \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SYNC();                                                                    \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+// The generic form checks its operands, then rewrites itself in the chunk
+// into the number-only form for the next execution.
+#define BINARY_OP(valueType, op, quickened)                                    \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    ip[-1] = quickened;                                                        \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(POP());                                               \
+    PUSH(valueType(a op b));                                                   \
+  } while (false)
+// The quickened form only guards its assumption. On a miss it restores the
+// generic instruction and re-dispatches it, which handles the slow path.
+#define DEOPTIMIZE(generic)                                                    \
+  do {                                                                         \
+    ip[-1] = generic;                                                          \
+    ip--;                                                                      \
+    DISPATCH();                                                                \
+  } while (false)
+#define BINARY_OP_NUM(valueType, op, generic)                                  \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) DEOPTIMIZE(generic);       \
+    double b = AS_NUMBER(POP());                                               \
+    sp[-1] = valueType(AS_NUMBER(sp[-1]) op b);                                \
+  } while (false)
+#define NEGATED_COMPARE(op)                                                    \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double b = AS_NUMBER(POP());                                               \
+    sp[-1] = BOOL_VAL(!(AS_NUMBER(sp[-1]) op b));                              \
+  } while (false)
+// The compiler only fuses number constants into these, so only the left
+// operand on the stack needs checking.
+#define BINARY_OP_CONSTANT(op, message)                                        \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    double b = AS_NUMBER(READ_CONSTANT());                                     \
+    if (!IS_NUMBER(PEEK(0))) {                                                 \
+      RUNTIME_ERROR(message);                                                  \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1]) op b);                               \
+  } while (false)
+// Pops both operands and jumps when `a op b` comes out as `jumpIf`. Jumping
+// on the comparison itself rather than its negation keeps NaN operands
+// behaving like the unfused compare and OP_JUMP_IF_FALSE.
+#define COMPARE_JUMP(op, jumpIf)                                               \
+  do {                                                                         \
+    uint16_t offset = READ_SHORT();                                            \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(POP());                                               \
+    if ((a op b) == jumpIf) ip += offset;                                      \
   } while (false)
 
-    for (;;)
-    {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("\t\t");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    printf("\t\t");                                                            \
+    for (Value* slot = vm.stack; slot < sp; slot++) {                          \
+      printf("[");                                                             \
+      printValue(*slot);                                                       \
+      printf("]");                                                             \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassembleInstruction(&frame->closure->function->chunk,                   \
+        (int)(ip - frame->closure->function->chunk.code));                     \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
+#endif /* ifdef DEBUG_TRACE_EXECUTION */
+
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    // One label per opcode. Every handler ends by jumping straight to the
+    // next handler, so each opcode gets its own indirect branch site.
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_POP] = &&op_OP_POP,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+        [OP_GET_CAPTURED] = &&op_OP_GET_CAPTURED,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+        [OP_INLINE_GUARD] = &&op_OP_INLINE_GUARD,
+        [OP_PEEK] = &&op_OP_PEEK,
+        [OP_INLINE_RETURN] = &&op_OP_INLINE_RETURN,
+        [OP_CLOSURE] = &&op_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_ADD_STR] = &&op_OP_ADD_STR,
+        [OP_SUBTRACT_NUM] = &&op_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM] = &&op_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM] = &&op_OP_DIVIDE_NUM,
+        [OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+        [OP_LESS_NUM] = &&op_OP_LESS_NUM,
+        [OP_GET_LOCAL_2] = &&op_OP_GET_LOCAL_2,
+        [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&op_OP_SET_GLOBAL_POP,
+        [OP_ADD_CONSTANT] = &&op_OP_ADD_CONSTANT,
+        [OP_SUBTRACT_CONSTANT] = &&op_OP_SUBTRACT_CONSTANT,
+        [OP_MULTIPLY_CONSTANT] = &&op_OP_MULTIPLY_CONSTANT,
+        [OP_DIVIDE_CONSTANT] = &&op_OP_DIVIDE_CONSTANT,
+        [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+        [OP_JUMP_IF_NOT_LESS] = &&op_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_GREATER] = &&op_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_EQUAL] = &&op_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_EQUAL] = &&op_OP_JUMP_IF_EQUAL,
+        [OP_JUMP_IF_LESS] = &&op_OP_JUMP_IF_LESS,
+        [OP_JUMP_IF_GREATER] = &&op_OP_JUMP_IF_GREATER,
+        [OP_POP_JUMP_IF_FALSE] = &&op_OP_POP_JUMP_IF_FALSE,
+        [OP_POP_JUMP_IF_TRUE] = &&op_OP_POP_JUMP_IF_TRUE,
+        [OP_WIDE] = &&op_OP_WIDE,
+    };
+    _Static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_COUNT,
+                   "Every opcode needs an entry in the dispatch table.");
+
+#define CASE(name) op_##name
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    goto *dispatchTable[READ_BYTE()];                                          \
+  } while (false)
+#define INTERPRET_LOOP DISPATCH();
+#else
+#define CASE(name) case name
+#define DISPATCH() goto loop
+#define INTERPRET_LOOP                                                         \
+  loop:                                                                        \
+    TRACE_INSTRUCTION();                                                       \
+    switch (READ_BYTE())
+#endif /* ifdef COMPUTED_GOTO */
+
+    INTERPRET_LOOP
+    {
+    CASE(OP_NEGATE):
+        if (!IS_NUMBER(PEEK(0)))
         {
-            printf("[");
-            printValue(*slot);
-            printf("]");
+            RUNTIME_ERROR("Operand must be a number.");
         }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int)(frame->ip - frame->closure->function->chunk.code));
-#endif /* ifdef DEBUG_TRACE_EXECUTION */
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
+        sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));
+        DISPATCH();
+    CASE(OP_ADD):
+        if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
         {
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(4)))
-            {
-                runtimeError("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_ADD:
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            ip[-1] = OP_ADD_STR;
+            SYNC();
+            concatenate();
+            sp = vm.stackTop;
+        }
+        else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+        {
+            ip[-1] = OP_ADD_NUM;
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            PUSH(NUMBER_VAL(a + b));
+        }
+        else
+        {
+            RUNTIME_ERROR("Operands must be two numbers or two string.");
+        }
+        DISPATCH();
+    CASE(OP_ADD_NUM):
+        BINARY_OP_NUM(NUMBER_VAL, +, OP_ADD);
+        DISPATCH();
+    CASE(OP_ADD_STR):
+        if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) DEOPTIMIZE(OP_ADD);
+        SYNC();
+        concatenate();
+        sp = vm.stackTop;
+        DISPATCH();
+    CASE(OP_SUBTRACT):
+        BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+        DISPATCH();
+    CASE(OP_SUBTRACT_NUM):
+        BINARY_OP_NUM(NUMBER_VAL, -, OP_SUBTRACT);
+        DISPATCH();
+    CASE(OP_MULTIPLY):
+        BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+        DISPATCH();
+    CASE(OP_MULTIPLY_NUM):
+        BINARY_OP_NUM(NUMBER_VAL, *, OP_MULTIPLY);
+        DISPATCH();
+    CASE(OP_DIVIDE):
+        BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+        DISPATCH();
+    CASE(OP_DIVIDE_NUM):
+        BINARY_OP_NUM(NUMBER_VAL, /, OP_DIVIDE);
+        DISPATCH();
+    CASE(OP_CONSTANT):
+        PUSH(READ_CONSTANT());
+        DISPATCH();
+    CASE(OP_NIL):
+        PUSH(NIL_VAL);
+        DISPATCH();
+    CASE(OP_TRUE):
+        PUSH(BOOL_VAL(true));
+        DISPATCH();
+    CASE(OP_FALSE):
+        PUSH(BOOL_VAL(false));
+        DISPATCH();
+    CASE(OP_NOT):
+        sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+        DISPATCH();
+    CASE(OP_EQUAL):
+        {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+    CASE(OP_GREATER):
+        BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+        DISPATCH();
+    CASE(OP_GREATER_NUM):
+        BINARY_OP_NUM(BOOL_VAL, >, OP_GREATER);
+        DISPATCH();
+    CASE(OP_LESS):
+        BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+        DISPATCH();
+    CASE(OP_LESS_NUM):
+        BINARY_OP_NUM(BOOL_VAL, <, OP_LESS);
+        DISPATCH();
+    CASE(OP_POP):
+        sp--;
+        DISPATCH();
+    CASE(OP_PRINT):
+        {
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        }
+    CASE(OP_DEFINE_GLOBAL):
+        vm.globalValues.values[READ_SHORT()] = POP();
+        DISPATCH();
+    CASE(OP_GET_GLOBAL):
+        {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value))
             {
-                concatenate();
+                RUNTIME_ERROR("Undefined variable '%s'.",
+                              AS_CSTRING(vm.globalNames.values[slot]));
             }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            PUSH(value);
+            DISPATCH();
+        }
+    CASE(OP_SET_GLOBAL):
+        {
+            uint16_t slot = READ_SHORT();
+            Value* global = &vm.globalValues.values[slot];
+            if (IS_UNDEFINED(*global))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                RUNTIME_ERROR("Undefined variable '%s'.",
+                              AS_CSTRING(vm.globalNames.values[slot]));
             }
-            else
+            *global = PEEK(0);
+            DISPATCH();
+        }
+    CASE(OP_GET_LOCAL):
+        {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+    CASE(OP_SET_LOCAL):
+        {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+    CASE(OP_JUMP_IF_FALSE):
+        {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+    CASE(OP_JUMP):
+        {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+    CASE(OP_LOOP):
+        {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            DISPATCH();
+        }
+    CASE(OP_CALL):
+        {
+            int argCount = READ_BYTE();
+            SYNC();
+            if (!callValue(PEEK(argCount), argCount))
             {
-                runtimeError("Operands must be two numbers or two string.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
-        case OP_SUBTRACT:
-            BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
-            BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
-            BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_CONSTANT:
-            {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
-        case OP_EQUAL:
-            {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-        case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_POP:
-            {
-                pop();
-                break;
-            }
-        case OP_PRINT:
-            {
-                printValue(pop());
-                printf("\n");
-                break;
-            }
-        case OP_DEFINE_GLOBAL:
-            {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
-        case OP_GET_GLOBAL:
+            LOAD_FRAME();
+            sp = vm.stackTop;
+            DISPATCH();
+        }
+    CASE(OP_TAIL_CALL):
+        {
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+            if (!IS_CLOSURE(callee))
             {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value))
+                SYNC();
+                if (!callValue(callee, argCount))
                 {
-                    runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
-                break;
+                LOAD_FRAME();
+                sp = vm.stackTop;
+                DISPATCH();
             }
-        case OP_SET_GLOBAL:
+
+            ObjClosure* closure = AS_CLOSURE(callee);
+            if (closure->function->source != NULL)
             {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0)))
+                SYNC();
+                if (!compileDeferred(closure->function))
                 {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                slots = frame->slots;
+                sp = vm.stackTop;
             }
-        case OP_GET_LOCAL:
+            if (argCount != closure->function->arity)
             {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+                RUNTIME_ERROR("Expected %d arguments but got %d.",
+                              closure->function->arity, argCount);
             }
-        case OP_SET_LOCAL:
+
+            // The caller's locals are dead from here on. Close over them,
+            // then slide the callee and its arguments down into the frame.
+            closeUpvalues(slots);
+            memmove(slots, sp - argCount - 1, (argCount + 1) * sizeof(Value));
+            sp = slots + argCount + 1;
+            frame->closure = closure;
+
+            Value* frameEnd = slots + closure->function->maxStack;
+            if (frameEnd > vm.stack + vm.stackCapacity)
             {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+                vm.stackTop = sp;
+                growStack((int)(frameEnd - sp));
+                slots = frame->slots;
+                sp = vm.stackTop;
             }
-        case OP_JUMP_IF_FALSE:
+
+            ip = closure->function->chunk.code;
+            constants = closure->function->chunk.constants.values;
+            DISPATCH();
+        }
+    CASE(OP_INLINE_GUARD):
+        {
+            uint16_t offset = READ_SHORT();
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            Value callee = PEEK(function->arity);
+            if (!IS_OBJ(callee) || AS_OBJ(callee) != (Obj*)function->closure)
             {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+                ip += offset;
             }
-        case OP_JUMP:
+            DISPATCH();
+        }
+    CASE(OP_PEEK):
+        {
+            Value value = PEEK(READ_BYTE());
+            PUSH(value);
+            DISPATCH();
+        }
+    CASE(OP_INLINE_RETURN):
+        {
+            int count = READ_BYTE();
+            sp[-1 - count] = sp[-1];
+            sp -= count;
+            DISPATCH();
+        }
+    CASE(OP_RETURN):
+        {
+            Value result = POP();
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if (vm.frameCount == 0)
             {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                vm.stackTop = slots;
+                return INTERPRET_OK;
             }
-        case OP_LOOP:
+
+            sp = slots;
+            PUSH(result);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+    CASE(OP_CLOSURE):
+        {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            if (function->closure != NULL)
             {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                PUSH(OBJ_VAL(function->closure));
+                DISPATCH();
             }
-        case OP_CALL:
+
+            SYNC();
+            ObjClosure* closure = newClosure(function);
+            PUSH(OBJ_VAL(closure));
+            vm.stackTop = sp;
+
+            int upvalue = 0;
+            int captured = 0;
+            while (upvalue + captured <
+                   closure->upvalueCount + closure->capturedCount)
             {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount))
+                uint8_t flags = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (flags & CAPTURE_BY_VALUE)
                 {
-                    return INTERPRET_RUNTIME_ERROR;
+                    Value value = flags & CAPTURE_LOCAL
+                                      ? slots[index]
+                                      : frame->closure->captured[index];
+                    closure->captured[captured++] = value;
+                    writeBarrier((Obj*)closure, value);
+                    continue;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+
+                // Capturing can collect, which may promote the closure.
+                ObjUpvalue* shared = flags & CAPTURE_LOCAL
+                                         ? captureUpvalue(slots + index)
+                                         : frame->closure->upvalues[index];
+                closure->upvalues[upvalue++] = shared;
+                writeBarrier((Obj*)closure, OBJ_VAL(shared));
+            }
+            DISPATCH();
+        }
+    CASE(OP_GET_UPVALUE):
+        {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+    CASE(OP_SET_UPVALUE):
+        {
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location = PEEK(0);
+            writeBarrier((Obj*)upvalue, PEEK(0));
+            DISPATCH();
+        }
+    CASE(OP_GET_CAPTURED):
+        PUSH(frame->closure->captured[READ_BYTE()]);
+        DISPATCH();
+    CASE(OP_CLOSE_UPVALUE):
+        closeLocal(sp - 1);
+        sp--;
+        DISPATCH();
+    CASE(OP_GET_LOCAL_2):
+        PUSH(slots[ip[0]]);
+        PUSH(slots[ip[1]]);
+        ip += 2;
+        DISPATCH();
+    CASE(OP_SET_LOCAL_POP):
+        slots[READ_BYTE()] = POP();
+        DISPATCH();
+    CASE(OP_SET_GLOBAL_POP):
+        {
+            uint16_t slot = READ_SHORT();
+            Value* global = &vm.globalValues.values[slot];
+            if (IS_UNDEFINED(*global))
+            {
+                RUNTIME_ERROR("Undefined variable '%s'.",
+                              AS_CSTRING(vm.globalNames.values[slot]));
             }
-        case OP_RETURN:
+            *global = POP();
+            DISPATCH();
+        }
+    CASE(OP_ADD_CONSTANT):
+        BINARY_OP_CONSTANT(+, "Operands must be two numbers or two string.");
+        DISPATCH();
+    CASE(OP_SUBTRACT_CONSTANT):
+        BINARY_OP_CONSTANT(-, "Operands must be numbers.");
+        DISPATCH();
+    CASE(OP_MULTIPLY_CONSTANT):
+        BINARY_OP_CONSTANT(*, "Operands must be numbers.");
+        DISPATCH();
+    CASE(OP_DIVIDE_CONSTANT):
+        BINARY_OP_CONSTANT(/, "Operands must be numbers.");
+        DISPATCH();
+    CASE(OP_NOT_EQUAL):
+        {
+            Value b = POP();
+            sp[-1] = BOOL_VAL(!valuesEqual(sp[-1], b));
+            DISPATCH();
+        }
+    // Negated comparisons, so NaN operands behave exactly like the unfused
+    // OP_LESS; OP_NOT and OP_GREATER; OP_NOT sequences.
+    CASE(OP_GREATER_EQUAL):
+        NEGATED_COMPARE(<);
+        DISPATCH();
+    CASE(OP_LESS_EQUAL):
+        NEGATED_COMPARE(>);
+        DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS):
+        COMPARE_JUMP(<, false);
+        DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER):
+        COMPARE_JUMP(>, false);
+        DISPATCH();
+    CASE(OP_JUMP_IF_LESS):
+        COMPARE_JUMP(<, true);
+        DISPATCH();
+    CASE(OP_JUMP_IF_GREATER):
+        COMPARE_JUMP(>, true);
+        DISPATCH();
+    CASE(OP_JUMP_IF_NOT_EQUAL):
+        {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (!valuesEqual(a, b)) ip += offset;
+            DISPATCH();
+        }
+    CASE(OP_JUMP_IF_EQUAL):
+        {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (valuesEqual(a, b)) ip += offset;
+            DISPATCH();
+        }
+    CASE(OP_POP_JUMP_IF_FALSE):
+        {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(POP())) ip += offset;
+            DISPATCH();
+        }
+    CASE(OP_POP_JUMP_IF_TRUE):
+        {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(POP())) ip += offset;
+            DISPATCH();
+        }
+    CASE(OP_WIDE):
+        {
+            // The short forms above stay lean; everything with an operand
+            // too big for them comes through here.
+            uint8_t instruction = READ_BYTE();
+            uint32_t operand = READ_WIDE();
+            switch (instruction)
             {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0)
+            case OP_CONSTANT:
+                PUSH(constants[operand]);
+                break;
+            case OP_GET_LOCAL:
+                PUSH(slots[operand]);
+                break;
+            case OP_SET_LOCAL:
+                slots[operand] = PEEK(0);
+                break;
+            case OP_GET_UPVALUE:
+                PUSH(*frame->closure->upvalues[operand]->location);
+                break;
+            case OP_SET_UPVALUE:
                 {
-                    pop();
-                    return INTERPRET_OK;
+                    ObjUpvalue* upvalue = frame->closure->upvalues[operand];
+                    *upvalue->location = PEEK(0);
+                    writeBarrier((Obj*)upvalue, PEEK(0));
                 }
-
-                vm.stackTop = frame->slots;
-                push(result);
-
-                frame = &vm.frames[vm.frameCount - 1];
                 break;
-            }
-        case OP_CLOSURE:
-            {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-
-                for (int i = 0; i < closure->upvalueCount; i++)
+            case OP_GET_CAPTURED:
+                PUSH(frame->closure->captured[operand]);
+                break;
+            case OP_DEFINE_GLOBAL:
+                vm.globalValues.values[operand] = POP();
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
                 {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal)
+                    Value* global = &vm.globalValues.values[operand];
+                    if (IS_UNDEFINED(*global))
+                    {
+                        RUNTIME_ERROR("Undefined variable '%s'.",
+                                      AS_CSTRING(vm.globalNames.values[operand]));
+                    }
+                    if (instruction == OP_GET_GLOBAL)
                     {
-                        closure->upvalues[i] =
-                            captureUpvalue(frame->slots + index);
+                        PUSH(*global);
                     }
                     else
                     {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+                        *global = PEEK(0);
                     }
+                    break;
                 }
+            case OP_JUMP:
+                ip += operand;
                 break;
-            }
-        case OP_GET_UPVALUE:
-            {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
+            case OP_LOOP:
+                ip -= operand;
                 break;
-            }
-        case OP_SET_UPVALUE:
-            {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+            case OP_JUMP_IF_FALSE:
+                if (isFalsey(PEEK(0))) ip += operand;
                 break;
-            }
-        case OP_CLOSE_UPVALUE:
-            {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
+            case OP_POP_JUMP_IF_FALSE:
+                if (isFalsey(POP())) ip += operand;
+                break;
+            case OP_POP_JUMP_IF_TRUE:
+                if (!isFalsey(POP())) ip += operand;
                 break;
+            case OP_CLOSURE:
+                {
+                    ObjFunction* function = AS_FUNCTION(constants[operand]);
+                    if (function->closure != NULL)
+                    {
+                        PUSH(OBJ_VAL(function->closure));
+                        break;
+                    }
+
+                    SYNC();
+                    ObjClosure* closure = newClosure(function);
+                    PUSH(OBJ_VAL(closure));
+                    vm.stackTop = sp;
+
+                    int upvalue = 0;
+                    int captured = 0;
+                    while (upvalue + captured <
+                           closure->upvalueCount + closure->capturedCount)
+                    {
+                        uint8_t flags = READ_BYTE();
+                        uint32_t index = READ_WIDE();
+                        if (flags & CAPTURE_BY_VALUE)
+                        {
+                            Value value = flags & CAPTURE_LOCAL
+                                              ? slots[index]
+                                              : frame->closure->captured[index];
+                            closure->captured[captured++] = value;
+                            writeBarrier((Obj*)closure, value);
+                            continue;
+                        }
+
+                        ObjUpvalue* shared =
+                            flags & CAPTURE_LOCAL
+                                ? captureUpvalue(slots + index)
+                                : frame->closure->upvalues[index];
+                        closure->upvalues[upvalue++] = shared;
+                        writeBarrier((Obj*)closure, OBJ_VAL(shared));
+                    }
+                    break;
+                }
+            default:
+                RUNTIME_ERROR("Unknown opcode %d.", instruction);
             }
+            DISPATCH();
         }
     }
 
+    // Only reachable from the switch fallback on a corrupt opcode byte.
+    RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+
+#undef LOAD_FRAME
+#undef SYNC
+#undef PUSH
+#undef POP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
-#undef READ_STRING
+#undef READ_WIDE
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef DEOPTIMIZE
+#undef BINARY_OP_NUM
+#undef BINARY_OP_CONSTANT
+#undef NEGATED_COMPARE
+#undef COMPARE_JUMP
+#undef TRACE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
+#undef INTERPRET_LOOP
 }
 
 void initVM()
 {
+    vm.frames = NULL;
+    vm.frameCapacity = 0;
+    vm.stack = NULL;
+    vm.stackCapacity = 0;
+    vm.openUpvalues = NULL;
+    vm.openOrder = NULL;
+    vm.openCount = 0;
+    vm.openCapacity = 0;
     resetStack();
     vm.objects = NULL;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.minorCollections = 0;
+    vm.majorCollections = 0;
+    vm.gcPauses = NULL;
+    vm.gcPauseCount = 0;
+    vm.gcPauseCapacity = 0;
+#ifdef GENERATIONAL_GC
+    vm.youngObjects = NULL;
+    vm.youngBytes = 0;
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+#endif
+#ifdef INCREMENTAL_GC
+    vm.gcPhase = GC_IDLE;
+    vm.sweeping = NULL;
+    vm.stepBytes = 0;
+    vm.gcStepBudget = GC_STEP_BUDGET;
+#endif
+#ifdef PARALLEL_GC
+    vm.gcThreads = 0;
+#endif
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
     initTable(&vm.strings);
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
+    growStack(UINT8_COUNT);
 
     defineNative("clock", clockNative);
     defineNative("len", lenNative);
@@ -477,12 +1152,21 @@ void freeVM()
 {
     freeObjects();
     freeTable(&vm.strings);
-    freeTable(&vm.globals);
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
+    FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    FREE_ARRAY(ObjUpvalue*, vm.openUpvalues, vm.stackCapacity);
+    FREE_ARRAY(ObjUpvalue*, vm.openOrder, vm.openCapacity);
+#ifdef POOL_ALLOCATOR
+    freePools();
+#endif
 }
 
-InterpretResult interpret(const char* source)
+InterpretResult interpret(const char* source, int passes, bool lazy)
 {
-    ObjFunction* function = compile(source);
+    ObjFunction* function = compile(source, passes, lazy);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
     push(OBJ_VAL(function));
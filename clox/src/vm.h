@@ -6,8 +6,11 @@
 #include "value.h"
 #include "object.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The deepest the call stack may get before a "Stack overflow." error. The
+// frame array and value stack start small and grow on demand up to it.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 10000
+#endif
 
 typedef struct
 {
@@ -16,21 +19,73 @@ typedef struct
     Value* slots;
 } CallFrame;
 
+#ifdef INCREMENTAL_GC
+typedef enum
+{
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+} GCPhase;
+#endif
+
 typedef struct
 {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
 
-    Value stack[STACK_MAX];
+    // Frames and open upvalues point into the stack, so growing it moves
+    // them along with it.
+    Value* stack;
     Value* stackTop;
+    int stackCapacity;
     Table strings;
-    Table globals;
-    ObjUpvalue* openUpvalues;
+
+    // Globals are resolved to slot indices at compile time. globalSlots maps
+    // a name to its index, and globalValues/globalNames are indexed by it.
+    Table globalSlots;
+    ValueArray globalValues;
+    ValueArray globalNames;
+
+    // Open upvalues, indexed by the stack slot they point at (sized like the
+    // stack), and the same upvalues in the order they were opened. That
+    // order groups them by frame, so returning closes a suffix of it.
+    ObjUpvalue** openUpvalues;
+    ObjUpvalue** openOrder;
+    int openCount;
+    int openCapacity;
 
     size_t bytesAllocated;
     size_t nextGC;
+    int minorCollections;
+    int majorCollections;
+    // How long each collection, or each incremental step, took in seconds.
+    double* gcPauses;
+    int gcPauseCount;
+    int gcPauseCapacity;
 
     Obj* objects;
+#ifdef GENERATIONAL_GC
+    // Objects allocated since the last collection. Everything in `objects`
+    // is old and stays marked until the next major collection starts.
+    Obj* youngObjects;
+    size_t youngBytes;
+    // Old objects that may point at young ones.
+    Obj** remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+#endif
+#ifdef INCREMENTAL_GC
+    GCPhase gcPhase;
+    // The rest of the list being swept. Survivors move back to `objects`.
+    Obj* sweeping;
+    size_t stepBytes;
+    int gcStepBudget;
+#endif
+#ifdef PARALLEL_GC
+    // Threads that trace the heap, or 0 for one per processor.
+    int gcThreads;
+#endif
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
@@ -47,7 +102,8 @@ extern VM vm;
 
 void initVM();
 void freeVM();
-InterpretResult interpret(const char* source);
+InterpretResult interpret(const char* source, int passes, bool lazy);
+int globalSlot(ObjString* name);
 void push(Value value);
 Value pop();
 